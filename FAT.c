@@ -1,12 +1,24 @@
+#ifdef __linux__
+#define _GNU_SOURCE /*fallocate*/
+#endif
 #include "FAT.h"
-#include <stddef.h> /*size_t, NULL*/
-#include <fcntl.h> /*open*/
-#include <unistd.h> /*close, ftruncate*/
+#include "compression.h"
+#include "crc32c.h"
+#include "trace.h"
+#include <stddef.h> /*size_t, NULL, offsetof*/
+#include <fcntl.h> /*open, fallocate, fcntl*/
+#include <sys/types.h> /*off_t, loff_t*/
+#include <unistd.h> /*close, ftruncate, copy_file_range, sysconf*/
 #include <sys/mman.h> /*mmap, munmap, msync*/
-#include <string.h> /*memcpy, strncpy, strncmp*/
+#include <string.h> /*memcpy, memchr, strncpy, strncmp, strcspn*/
 #include <errno.h> /*errno*/
-#include <malloc.h> /*malloc*/
+#include <malloc.h> /*malloc, realloc*/
 #include <assert.h> /*assert*/
+#include <limits.h> /*INT_MAX*/
+#include <pthread.h> /*pthread_create, pthread_join, pthread_mutex_lock*/
+#include <stdlib.h> /*qsort*/
+#include <fnmatch.h> /*fnmatch*/
+#include <time.h> /*struct timespec, CLOCK_MONOTONIC*/
 
 #define TOTAL_BLOCKS 1024
 #define BLOCK_BUFFER_SIZE 512
@@ -22,13 +34,59 @@
 
 #define ROOT_WORKING_DIRECTORY 0
 
+/*
+* The contents of the file are stored as compressed clusters,
+* the chain starts with the offsets of each cluster followed by the clusters themselves.
+*/
+#define FAT_FLAG_COMPRESSED 1
+/*
+* The file is small enough to be stored in the space used by the children of directories,
+* no block is allocated for it.
+*/
+#define FAT_FLAG_INLINE 2
+
+#define COMPRESSION_CLUSTER_SIZE (BLOCK_BUFFER_SIZE * 8)
+
+/*
+* File handles are allocated in chunks of this many slots.
+*/
+#define HANDLE_CHUNK_SIZE 64
+
+/*
+* With FAT_CHECKSUM_SAMPLED, one block read out of this many is verified.
+*/
+#define CHECKSUM_SAMPLE_RATE 16
+#define MAX_SCRUB_THREADS 16
+/*
+* The cluster offsets of compressed files are 32 bit, bigger files are kept uncompressed.
+*/
+#define MAX_COMPRESSED_FILE_SIZE ((FAT_uint32_t)(~0) / 2)
+
+/*
+* Positions in a file are stored as a 32 bit block index, the last few indices are
+* kept free so that computing the position of the block after a hole can't overflow.
+*/
+#define MAX_FILE_BLOCKS (LAST_FAT_ENTRY - 1)
+#define MAX_FILE_SIZE ((FAT_uint64_t)MAX_FILE_BLOCKS * BLOCK_BUFFER_SIZE)
+
 typedef struct DirectoryEntry {
 	char filename[DIRECTORY_ENTRY_MAX_NAME];
 	FAT_uint8_t file_type;
+	FAT_uint8_t flags;
 	FAT_uint8_t num_children;
 	FAT_uint16_t parent_directory;
-	FAT_uint32_t size;
+	/*
+	* For directories, the sum of the sizes of all the files below it
+	*/
+	FAT_uint64_t size;
 	FAT_uint32_t first_fat_entry;
+	/*
+	* Only used by directories: number of files and directories below it,
+	* and the limits of size and total_entries set by setDirQuotaFAT, 0 if unlimited.
+	*/
+	FAT_uint32_t total_entries;
+	FAT_uint32_t max_entries;
+	FAT_uint64_t max_size;
 	FAT_uint16_t children[MAX_DIR_CHILDREN];
 } DirectoryEntry;
 
@@ -40,81 +98,485 @@ typedef struct FATTable {
 	FAT_uint32_t entries[TOTAL_BLOCKS];
 } FATTable;
 
+/*
+* Number of additional references to each block, a block is referenced by
+* either a directory entry or by the FAT entry of the block preceding it,
+* 0 means that the block is used by a single file.
+*/
+typedef struct BlockRefTable {
+	FAT_uint16_t shared_refs[TOTAL_BLOCKS];
+} BlockRefTable;
+
+/*
+* Number of blocks after each block of a file that were never written (holes),
+* and that come before the block it points to in the FAT.
+* Holes after the last block of a file aren't stored, every position in a file
+* past its last block is a hole.
+*/
+typedef struct HoleTable {
+	FAT_uint32_t hole_blocks[TOTAL_BLOCKS];
+} HoleTable;
+
 typedef struct DirectoryTable {
 	DirectoryEntry entries[TOTAL_DIR_ENTRIES];
 } DirectoryTable;
 
+/*
+* CRC32C of the contents of each block, 0 if it's not known (the block was
+* written with the checksums turned off), a checksum that is really 0 is stored as 1.
+* metadata covers all the tables preceding this one, it's computed when the disk
+* is closed and is 0 while the disk is opened for writing.
+*/
+typedef struct ChecksumTable {
+	FAT_uint32_t metadata;
+	FAT_uint32_t blocks[TOTAL_BLOCKS];
+} ChecksumTable;
+
+typedef struct DiskCounters {
+	/*
+	* All the blocks before this one are in use, lowered every time a block is
+	* released, so that looking for a free block doesn't rescan the full disk.
+	*/
+	FAT_uint32_t first_free_block;
+	/*
+	* Sum of the shared_refs of all the blocks, while it's 0 writes don't need
+	* to look for shared blocks to copy.
+	*/
+	FAT_uint32_t shared_refs;
+} DiskCounters;
+
+/*
+* Only used by the processes that mount the disk with initSharedFAT, the first
+* of them to mount the disk initializes it again.
+* generation is incremented every time one of them changes the disk, so that the
+* others drop what they cached from it.
+*/
+typedef struct LockArea {
+	pthread_mutex_t mutex;
+	FAT_uint32_t generation;
+	DiskCounters counters;
+} LockArea;
+
 typedef struct Disk {
 	FATTable fat;
+	BlockRefTable refs;
+	HoleTable holes;
 	DirectoryTable directories;
+	ChecksumTable checksums;
+	LockArea lock;
 	FileBlock blocks[TOTAL_BLOCKS];
 } Disk;
 
+/*
+* Slots for the file handles opened in a FAT, the slots are allocated in chunks
+* that never move, so that the Handle pointers stay valid when the table grows.
+*/
+typedef struct HandleTable {
+	struct FileHandle** chunks;
+	int total_chunks;
+	/*
+	* Head of the list of the free slots, -1 if all the slots are in use.
+	*/
+	int first_free;
+} HandleTable;
+
+/*
+* State shared by a FAT and its flusher thread, protected by mutex.
+*/
+typedef struct Flusher {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	/*
+	* Signaled when there are new changes to write back, or the thread has to stop.
+	*/
+	pthread_cond_t wake;
+	FlushPolicy policy;
+	Disk* disk;
+	/*
+	* Blocks handed over by the FAT and not written back yet, the tables are
+	* written back every time something changed.
+	*/
+	FAT_uint8_t dirty_blocks[(TOTAL_BLOCKS + 7) / 8];
+	FAT_uint32_t total_dirty_blocks;
+	int dirty;
+	/*
+	* Time of the oldest change not written back yet, as returned by getTraceTime.
+	*/
+	FAT_uint64_t dirty_since;
+	int stop;
+	/*
+	* errno value of the last failed write back, 0 if none failed.
+	*/
+	int error;
+	FlushStats stats;
+} Flusher;
+
 typedef struct FATBackingDisk {
 	size_t currently_mapped_size;
 	Disk* mmapped_disk;
 	int mmapped_file_descriptor;
 	FAT_uint16_t current_working_directory;
+	int read_only;
+	/*
+	* Incremented every time a file gets compressed or decompressed,
+	* to invalidate the clusters cached by the file handles.
+	*/
+	FAT_uint32_t compression_generation;
+	/*
+	* Points to local_counters, or to the counters in the lock area if the disk is shared.
+	*/
+	DiskCounters* counters;
+	DiskCounters local_counters;
+	HandleTable handles;
+	ChecksumMode checksum_mode;
+	/*
+	* Counts the block reads, to pick the ones to verify with FAT_CHECKSUM_SAMPLED.
+	*/
+	FAT_uint32_t sampled_reads;
+	/*
+	* Bitmap of the blocks whose checksum was verified or computed since the disk
+	* was opened, used by FAT_CHECKSUM_LAZY.
+	*/
+	FAT_uint8_t verified_blocks[(TOTAL_BLOCKS + 7) / 8];
+	/*
+	* Bitmap of the blocks written since their checksum was last computed, see
+	* updateBlockChecksum.
+	*/
+	FAT_uint8_t stale_checksums[(TOTAL_BLOCKS + 7) / 8];
+	/*
+	* The metadata didn't match its checksum when the disk was opened.
+	*/
+	int metadata_corrupted;
+	/*
+	* Incremented every time a block is removed from a chain, invalidating the
+	* blocks cached by the file handles.
+	*/
+	FAT_uint32_t chain_generation;
+	/*
+	* The used directory entries sorted by name, rebuilt by findFAT the first time
+	* it's called after a name was added, removed or changed.
+	*/
+	DirectoryEntry* name_index[TOTAL_DIR_ENTRIES];
+	int total_indexed_names;
+	int name_index_valid;
+	/*
+	* NULL if the disk wasn't mounted with initSharedFAT.
+	*/
+	LockArea* shared;
+	/*
+	* Generation of the lock area when this process last used the disk.
+	*/
+	FAT_uint32_t seen_generation;
+	/*
+	* The functions locking the disk can call each other, the generation is only
+	* checked and updated by the outermost one.
+	*/
+	int lock_depth;
+	int changed_while_locked;
+	/*
+	* Every call is recorded here while a trace is running, NULL otherwise.
+	*/
+	FILE* trace;
+	/*
+	* Blocks changed by the call in progress, handed over to the flusher thread
+	* when it's done.
+	*/
+	FAT_uint8_t dirty_blocks[(TOTAL_BLOCKS + 7) / 8];
+	/*
+	* NULL while the flusher thread isn't running.
+	*/
+	Flusher* flusher;
+	/*
+	* Counters of the flusher threads that were stopped.
+	*/
+	FlushStats flush_stats;
 } FATBackingDisk;
 
+typedef struct ClusterCache {
+	FAT_uint32_t generation;
+	FAT_uint32_t cluster;
+	char compressed[COMPRESSION_CLUSTER_SIZE];
+	char data[COMPRESSION_CLUSTER_SIZE];
+} ClusterCache;
+
 typedef struct FileHandle {
 	FAT_uint32_t current_pos;
 	FAT_uint32_t current_block_index;
 	FAT_uint32_t directory_entry;
 	FAT backing_disk;
+	/*
+	* Last decompressed cluster, allocated on the first read of a compressed file.
+	*/
+	ClusterCache* cluster_cache;
+	/*
+	* Position of the handle in the handle table of its FAT, when the slot is free
+	* backing_disk is NULL and next_free is the next free slot.
+	*/
+	int descriptor;
+	int next_free;
+	/*
+	* Last block of the file reached through the handle and its position in the file,
+	* so that sequential accesses don't walk the chain from its start every time.
+	* Only valid while cached_generation matches the chain_generation of the FAT.
+	*/
+	FAT_uint32_t cached_fat_entry;
+	FAT_uint32_t cached_block_index;
+	FAT_uint32_t cached_generation;
 } FileHandle;
 
+#define getHandleSlot(table, descriptor) (&((table)->chunks[(descriptor) / HANDLE_CHUNK_SIZE][(descriptor) % HANDLE_CHUNK_SIZE]))
+
 static void setupRootDir(FATBackingDisk* disk);
+static FAT_int64_t readFAT64Unlocked(Handle from, void* out, size_t size);
+static void settleStaleChecksums(FATBackingDisk* backing_disk);
 
-FAT initFAT(const char* diskname, int anew) {
-	int prev_errno;
-	int descriptor;
-	int flags = O_CREAT | O_RDWR;
+#define normalizeChecksum(crc) ((crc) == 0 ? 1 : (crc))
+#define computeMetadataChecksum(disk) normalizeChecksum(crc32c(0, (disk), offsetof(Disk, checksums)))
+
+static FATBackingDisk* mapBackingDisk(int descriptor, int read_only) {
+	int i;
 	FATBackingDisk* backing_disk = (FATBackingDisk*)malloc(sizeof(FATBackingDisk));
 	if(backing_disk == NULL)
-		goto error;
-	if(anew)
-		flags |= O_TRUNC;
-	backing_disk->mmapped_file_descriptor = open(diskname, flags, 0666);
-	if(backing_disk->mmapped_file_descriptor == -1)
-		goto error;
-	if(anew) {
-		if(ftruncate(backing_disk->mmapped_file_descriptor, sizeof(Disk)) != 0)
-			goto error;
-	}
+		return NULL;
 	backing_disk->mmapped_disk = (Disk*)mmap(NULL,
 												sizeof(Disk),
-												PROT_READ | PROT_WRITE,
+												read_only ? PROT_READ : (PROT_READ | PROT_WRITE),
 												MAP_SHARED,
-												backing_disk->mmapped_file_descriptor,
+												descriptor,
 												0);
-	if(backing_disk->mmapped_disk == MAP_FAILED)
+	if(backing_disk->mmapped_disk == MAP_FAILED) {
+		free(backing_disk);
+		return NULL;
+	}
+	backing_disk->mmapped_file_descriptor = descriptor;
+	backing_disk->currently_mapped_size = sizeof(Disk);
+	backing_disk->current_working_directory = ROOT_WORKING_DIRECTORY;
+	backing_disk->read_only = read_only;
+	backing_disk->compression_generation = 0;
+	backing_disk->counters = &backing_disk->local_counters;
+	backing_disk->local_counters.first_free_block = 0;
+	backing_disk->handles.chunks = NULL;
+	backing_disk->handles.total_chunks = 0;
+	backing_disk->handles.first_free = -1;
+	backing_disk->checksum_mode = FAT_CHECKSUM_OFF;
+	backing_disk->sampled_reads = 0;
+	memset(backing_disk->verified_blocks, 0, sizeof(backing_disk->verified_blocks));
+	memset(backing_disk->stale_checksums, 0, sizeof(backing_disk->stale_checksums));
+	initCrc32c();
+	backing_disk->metadata_corrupted = backing_disk->mmapped_disk->checksums.metadata != 0 &&
+		backing_disk->mmapped_disk->checksums.metadata != computeMetadataChecksum(backing_disk->mmapped_disk);
+	/*
+	* The metadata is going to change from now on
+	*/
+	if(!read_only)
+		backing_disk->mmapped_disk->checksums.metadata = 0;
+	backing_disk->chain_generation = 0;
+	backing_disk->local_counters.shared_refs = 0;
+	backing_disk->name_index_valid = 0;
+	backing_disk->shared = NULL;
+	backing_disk->lock_depth = 0;
+	backing_disk->changed_while_locked = 0;
+	backing_disk->trace = NULL;
+	memset(backing_disk->dirty_blocks, 0, sizeof(backing_disk->dirty_blocks));
+	backing_disk->flusher = NULL;
+	memset(&backing_disk->flush_stats, 0, sizeof(backing_disk->flush_stats));
+	for(i = 0; i < TOTAL_BLOCKS; ++i)
+		backing_disk->local_counters.shared_refs += backing_disk->mmapped_disk->refs.shared_refs[i];
+	return backing_disk;
+}
+
+/*
+* Every mount of a shared disk holds a read lock on this byte of the disk file,
+* so the first one to mount it is the only one able to lock it for writing.
+*/
+#define MOUNT_LOCK_BYTE 0
+/*
+* Locked for writing while a disk is being formatted, or a shared disk mounted or unmounted.
+*/
+#define MOUNT_SERIALIZATION_LOCK_BYTE 1
+
+/*
+* The locks belong to the open file, not to the process as the classic record
+* locks do, so that the same disk can be mounted more than once by a process
+* and closing one of its mounts doesn't release the locks of the others.
+*/
+#ifdef F_OFD_SETLK
+#define SET_FILE_LOCK F_OFD_SETLK
+#define SET_FILE_LOCK_WAIT F_OFD_SETLKW
+#else
+#define SET_FILE_LOCK F_SETLK
+#define SET_FILE_LOCK_WAIT F_SETLKW
+#endif
+
+static int lockFileByte(int descriptor, short type, off_t byte, int wait) {
+	struct flock lock;
+	memset(&lock, 0, sizeof(lock));
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = byte;
+	lock.l_len = 1;
+	while(fcntl(descriptor, wait ? SET_FILE_LOCK_WAIT : SET_FILE_LOCK, &lock) == -1) {
+		if(errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+* The mutex is robust, so that a process dying while holding it doesn't lock out the
+* others, and recursive, so that the public functions can call each other.
+*/
+static int initLockArea(FATBackingDisk* backing_disk) {
+	int err;
+	pthread_mutexattr_t attributes;
+	LockArea* lock = &backing_disk->mmapped_disk->lock;
+	err = pthread_mutexattr_init(&attributes);
+	if(err == 0) {
+		if((err = pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED)) == 0 &&
+		   (err = pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST)) == 0 &&
+		   (err = pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE)) == 0)
+			err = pthread_mutex_init(&lock->mutex, &attributes);
+		pthread_mutexattr_destroy(&attributes);
+	}
+	if(err != 0) {
+		errno = err;
+		return -1;
+	}
+	/*
+	* The disk could have been changed by a process that didn't share it
+	*/
+	lock->counters = backing_disk->local_counters;
+	++(lock->generation);
+	return 0;
+}
+
+/*
+* Formatting and shared mounts hold the serialization lock from before the file is
+* truncated until the mount is set up, and a disk still mounted as shared is never
+* formatted, as that would wipe the lock area the other mounts are using.
+*/
+static FATBackingDisk* openBackingDisk(const char* diskname, int anew, int shared) {
+	int prev_errno;
+	int descriptor;
+	int first_mount = 1;
+	FATBackingDisk* backing_disk = NULL;
+	descriptor = open(diskname, O_CREAT | O_RDWR, 0666);
+	if(descriptor == -1)
+		return NULL;
+	if(anew || shared) {
+		if(lockFileByte(descriptor, F_WRLCK, MOUNT_SERIALIZATION_LOCK_BYTE, 1) == -1)
+			goto error;
+		if(lockFileByte(descriptor, F_WRLCK, MOUNT_LOCK_BYTE, 0) == -1) {
+			if(errno != EACCES && errno != EAGAIN)
+				goto error;
+			if(anew) {
+				errno = EBUSY;
+				goto error;
+			}
+			first_mount = 0;
+		}
+	}
+	if(anew) {
+		if(ftruncate(descriptor, 0) != 0 || ftruncate(descriptor, sizeof(Disk)) != 0)
+			goto error;
+	}
+	backing_disk = mapBackingDisk(descriptor, 0);
+	if(backing_disk == NULL)
 		goto error;
 	if(anew) {
 		memset(&(backing_disk->mmapped_disk->fat), 0xff, sizeof(FATTable));
 		setupRootDir(backing_disk);
 	}
-	backing_disk->currently_mapped_size = sizeof(FATTable) + sizeof(FileBlock) * TOTAL_BLOCKS;
-	backing_disk->current_working_directory = ROOT_WORKING_DIRECTORY;
+	if(shared) {
+		if(first_mount && initLockArea(backing_disk) == -1)
+			goto error;
+		/*
+		* Turns the write lock taken by the first mount into a read lock
+		*/
+		if(lockFileByte(descriptor, F_RDLCK, MOUNT_LOCK_BYTE, 1) == -1)
+			goto error;
+		backing_disk->shared = &backing_disk->mmapped_disk->lock;
+		backing_disk->counters = &backing_disk->shared->counters;
+		backing_disk->seen_generation = backing_disk->shared->generation;
+	} else if(anew && lockFileByte(descriptor, F_UNLCK, MOUNT_LOCK_BYTE, 0) == -1) {
+		goto error;
+	}
+	if((anew || shared) && lockFileByte(descriptor, F_UNLCK, MOUNT_SERIALIZATION_LOCK_BYTE, 0) == -1)
+		goto error;
 	return backing_disk;
 error:
-	if(backing_disk == NULL) /* Nothing to free */
-		return NULL;
-	descriptor = backing_disk->mmapped_file_descriptor;
-	free(backing_disk);
-	if(descriptor == -1)
-		return NULL;
 	prev_errno = errno;
+	if(backing_disk != NULL) {
+		munmap(backing_disk->mmapped_disk, backing_disk->currently_mapped_size);
+		free(backing_disk);
+	}
 	close(descriptor);
 	errno = prev_errno;
 	return NULL;
 }
 
+FAT initFAT(const char* diskname, int anew) {
+	return openBackingDisk(diskname, anew, 0);
+}
+
+FAT initSharedFAT(const char* diskname, int anew) {
+	return openBackingDisk(diskname, anew, 1);
+}
+
+/*
+* Returns nonzero if no other process has the disk mounted, the disk can't be
+* mounted again until it's closed afterwards.
+*/
+static int isLastMount(FATBackingDisk* backing_disk) {
+	if(backing_disk->shared == NULL)
+		return 1;
+	if(lockFileByte(backing_disk->mmapped_file_descriptor, F_WRLCK, MOUNT_SERIALIZATION_LOCK_BYTE, 1) == -1)
+		return 0;
+	return lockFileByte(backing_disk->mmapped_file_descriptor, F_WRLCK, MOUNT_LOCK_BYTE, 0) == 0;
+}
+
+static void releaseHandle(FATBackingDisk* backing_disk, FileHandle* handle) {
+	free(handle->cluster_cache);
+	handle->cluster_cache = NULL;
+	handle->backing_disk = NULL;
+	handle->next_free = backing_disk->handles.first_free;
+	backing_disk->handles.first_free = handle->descriptor;
+}
+
+static void freeHandleTable(HandleTable* table) {
+	int i;
+	int descriptor;
+	FileHandle* handle;
+	for(i = 0; i < table->total_chunks; ++i) {
+		for(descriptor = i * HANDLE_CHUNK_SIZE; descriptor < (i + 1) * HANDLE_CHUNK_SIZE; ++descriptor) {
+			handle = getHandleSlot(table, descriptor);
+			if(handle->backing_disk != NULL)
+				free(handle->cluster_cache);
+		}
+		free(table->chunks[i]);
+	}
+	free(table->chunks);
+}
+
 int terminateFAT(FAT fat) {
 	int has_err;
 	int err;
 	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
-	has_err = err = msync(backing_disk->mmapped_disk, backing_disk->currently_mapped_size, MS_SYNC);
+	stopTraceFAT(fat);
+	/*
+	* Before the last write back of the flusher, that includes the checksums
+	*/
+	settleStaleChecksums(backing_disk);
+	has_err = stopFlusherFAT(fat);
+	freeHandleTable(&backing_disk->handles);
+	/*
+	* The other processes sharing the disk are still changing it
+	*/
+	if(!backing_disk->read_only && isLastMount(backing_disk))
+		backing_disk->mmapped_disk->checksums.metadata = computeMetadataChecksum(backing_disk->mmapped_disk);
+	err = msync(backing_disk->mmapped_disk, backing_disk->currently_mapped_size, MS_SYNC);
+	if(err != 0)
+		has_err = err;
 	err = munmap(backing_disk->mmapped_disk, backing_disk->currently_mapped_size);
 	if(err != 0)
 		has_err = err;
@@ -125,10 +587,160 @@ int terminateFAT(FAT fat) {
 	return has_err;
 }
 
+static int copyDiskFile(FATBackingDisk* backing_disk, int to) {
+	const char* cur = (const char*)backing_disk->mmapped_disk;
+	size_t remaining = sizeof(Disk);
+	ssize_t written;
+#ifdef __linux__
+	/*
+	* copy_file_range lets the host filesystem share the extents between the
+	* two files (reflink) when it supports it, only falling back to copying
+	* the data in the kernel otherwise.
+	*/
+	loff_t in_offset = 0;
+	loff_t out_offset = 0;
+	while(remaining > 0) {
+		written = copy_file_range(backing_disk->mmapped_file_descriptor, &in_offset, to, &out_offset, remaining, 0);
+		if(written <= 0)
+			break;
+		remaining -= (size_t)written;
+	}
+	if(remaining == 0)
+		return 0;
+	cur += sizeof(Disk) - remaining;
+	if(lseek(to, (off_t)(sizeof(Disk) - remaining), SEEK_SET) == -1)
+		return -1;
+#endif
+	while(remaining > 0) {
+		written = write(to, cur, remaining);
+		if(written < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		remaining -= (size_t)written;
+		cur += written;
+	}
+	return 0;
+}
+
+static FAT snapshotFATUnlocked(FAT fat, const char* snapshot_name) {
+	int prev_errno;
+	int descriptor;
+	FATBackingDisk* snapshot;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	descriptor = open(snapshot_name, O_CREAT | O_RDWR | O_TRUNC, 0666);
+	if(descriptor == -1)
+		return NULL;
+	settleStaleChecksums(backing_disk);
+	if(copyDiskFile(backing_disk, descriptor) != 0)
+		goto error;
+	snapshot = mapBackingDisk(descriptor, 1);
+	if(snapshot == NULL)
+		goto error;
+	return snapshot;
+error:
+	prev_errno = errno;
+	close(descriptor);
+	errno = prev_errno;
+	return NULL;
+}
+
 #define getEntryFromIndex(index) (&(backing_disk->mmapped_disk->directories.entries[index]))
+#define invalidateNameIndex(backing_disk) ((backing_disk)->name_index_valid = 0)
 #define getBlockFromIndex(index) (&(backing_disk->mmapped_disk->blocks[index]))
 #define getNextFatEntry(entry) (backing_disk->mmapped_disk->fat.entries[entry])
 #define setNextFatEntry(entry,to) do { backing_disk->mmapped_disk->fat.entries[entry] = (FAT_uint32_t)to; } while(0)
+#define getBlockRefs(entry) (backing_disk->mmapped_disk->refs.shared_refs[entry])
+#define addBlockRef(entry) do { ++getBlockRefs(entry); ++(backing_disk->counters->shared_refs); } while(0)
+#define dropBlockRef(entry) do { --getBlockRefs(entry); --(backing_disk->counters->shared_refs); } while(0)
+#define getHoleBlocks(entry) (backing_disk->mmapped_disk->holes.hole_blocks[entry])
+#define getBlockChecksum(entry) (backing_disk->mmapped_disk->checksums.blocks[entry])
+
+#define isBlockVerified(entry) (backing_disk->verified_blocks[(entry) / 8] & (1 << ((entry) % 8)))
+#define markBlockVerified(entry) do { backing_disk->verified_blocks[(entry) / 8] |= (FAT_uint8_t)(1 << ((entry) % 8)); } while(0)
+#define clearBlockVerified(entry) do { backing_disk->verified_blocks[(entry) / 8] &= (FAT_uint8_t)~(1 << ((entry) % 8)); } while(0)
+#define markBlockDirty(entry) do { backing_disk->dirty_blocks[(entry) / 8] |= (FAT_uint8_t)(1 << ((entry) % 8)); } while(0)
+#define isChecksumStale(entry) (backing_disk->stale_checksums[(entry) / 8] & (1 << ((entry) % 8)))
+#define markChecksumStale(entry) do { backing_disk->stale_checksums[(entry) / 8] |= (FAT_uint8_t)(1 << ((entry) % 8)); } while(0)
+#define clearChecksumStale(entry) do { backing_disk->stale_checksums[(entry) / 8] &= (FAT_uint8_t)~(1 << ((entry) % 8)); } while(0)
+
+static void computeBlockChecksum(FATBackingDisk* backing_disk, FAT_uint32_t block_index) {
+	getBlockChecksum(block_index) = normalizeChecksum(crc32c(0, getBlockFromIndex(block_index), sizeof(FileBlock)));
+	clearChecksumStale(block_index);
+	markBlockVerified(block_index);
+}
+
+/*
+* Must be called every time the contents of a block change.
+* With the checksums turned off, the checksum is dropped instead, so that
+* it doesn't go stale.
+* With FAT_CHECKSUM_LAZY a written block counts as verified, so its checksum is
+* only marked stale, and computed once by settleStaleChecksums instead of on
+* every write. Until then it's stored as unknown, so that the old one doesn't
+* fail the reads if the disk isn't terminated. The other processes sharing a
+* disk verify the checksums, so there they're always computed right away.
+*/
+static void updateBlockChecksum(FATBackingDisk* backing_disk, FAT_uint32_t block_index) {
+	markBlockDirty(block_index);
+	if(backing_disk->checksum_mode == FAT_CHECKSUM_OFF) {
+		getBlockChecksum(block_index) = 0;
+		return;
+	}
+	if(backing_disk->checksum_mode == FAT_CHECKSUM_LAZY && backing_disk->shared == NULL) {
+		getBlockChecksum(block_index) = 0;
+		markChecksumStale(block_index);
+		markBlockVerified(block_index);
+		return;
+	}
+	computeBlockChecksum(backing_disk, block_index);
+}
+
+/*
+* Computes the checksums left stale by updateBlockChecksum, must be called before
+* they're read by anything other than this FAT, or the checksum mode is changed.
+*/
+static void settleStaleChecksums(FATBackingDisk* backing_disk) {
+	FAT_uint32_t i;
+	FAT_uint32_t block_index;
+	for(i = 0; i < sizeof(backing_disk->stale_checksums); ++i) {
+		if(backing_disk->stale_checksums[i] == 0)
+			continue;
+		for(block_index = i * 8; block_index < (i + 1) * 8; ++block_index) {
+			if(isChecksumStale(block_index))
+				computeBlockChecksum(backing_disk, block_index);
+		}
+	}
+}
+
+/*
+* Checks the block against its checksum if the checksum mode requires it.
+* Returns -1 and sets errno to EIO if they don't match.
+*/
+static int verifyBlockChecksum(FATBackingDisk* backing_disk, FAT_uint32_t block_index) {
+	switch(backing_disk->checksum_mode) {
+		case FAT_CHECKSUM_OFF:
+			return 0;
+		case FAT_CHECKSUM_LAZY:
+			if(isBlockVerified(block_index))
+				return 0;
+			break;
+		case FAT_CHECKSUM_SAMPLED:
+			if(++(backing_disk->sampled_reads) % CHECKSUM_SAMPLE_RATE != 0)
+				return 0;
+			break;
+		default:
+			break;
+	}
+	if(getBlockChecksum(block_index) == 0)
+		return 0;
+	if(getBlockChecksum(block_index) != normalizeChecksum(crc32c(0, getBlockFromIndex(block_index), sizeof(FileBlock)))) {
+		errno = EIO;
+		return -1;
+	}
+	markBlockVerified(block_index);
+	return 0;
+}
 
 static void setupRootDir(FATBackingDisk* backing_disk) {
 	DirectoryEntry* entry = getEntryFromIndex(ROOT_WORKING_DIRECTORY);
@@ -168,16 +780,90 @@ static int findDirEntry(FATBackingDisk* backing_disk, const char* filename, int*
 
 static int findFreeBlock(FATBackingDisk* backing_disk) {
 	int i;
-	for(i = 0; i < TOTAL_BLOCKS; ++i) {
-		if(backing_disk->mmapped_disk->fat.entries[i] == UNUSED_FAT_ENTRY)
+	for(i = (int)backing_disk->counters->first_free_block; i < TOTAL_BLOCKS; ++i) {
+		if(backing_disk->mmapped_disk->fat.entries[i] == UNUSED_FAT_ENTRY) {
+			backing_disk->counters->first_free_block = (FAT_uint32_t)i;
 			return i;
+		}
 	}
+	backing_disk->counters->first_free_block = TOTAL_BLOCKS;
 	return -1;
 }
 
-static void addChildToFolder(DirectoryEntry* parent, FAT_uint16_t child) {
+#define getEntryCount(entry) ((entry)->file_type == FAT_DIRECTORY ? (entry)->total_entries + 1 : 1)
+
+/*
+* Adds to the totals of the passed directory and of all the directories containing it,
+* so that they never have to be computed by walking the tree.
+*/
+static void updateDirTotals(FATBackingDisk* backing_disk, FAT_uint16_t directory_id, FAT_int64_t size, FAT_int32_t entries) {
+	DirectoryEntry* directory;
+	for(;;) {
+		directory = getEntryFromIndex(directory_id);
+		directory->size += (FAT_uint64_t)size;
+		directory->total_entries += (FAT_uint32_t)entries;
+		if(directory_id == ROOT_WORKING_DIRECTORY)
+			break;
+		directory_id = directory->parent_directory;
+	}
+}
+
+/*
+* Returns how many bytes can be added below the passed directory before going
+* over its quota or the quota of one of the directories containing it.
+*/
+static FAT_uint64_t getDirSizeRoom(FATBackingDisk* backing_disk, FAT_uint16_t directory_id) {
+	DirectoryEntry* directory;
+	FAT_uint64_t room = MAX_FILE_SIZE;
+	for(;;) {
+		directory = getEntryFromIndex(directory_id);
+		if(directory->max_size != 0) {
+			if(directory->size >= directory->max_size)
+				return 0;
+			if(directory->max_size - directory->size < room)
+				room = directory->max_size - directory->size;
+		}
+		if(directory_id == ROOT_WORKING_DIRECTORY)
+			return room;
+		directory_id = directory->parent_directory;
+	}
+}
+
+/*
+* Returns -1 and sets errno to EDQUOT if adding the passed bytes and entries below
+* the directory would go over a quota.
+*/
+static int checkDirQuotas(FATBackingDisk* backing_disk, FAT_uint16_t directory_id, FAT_uint64_t size, FAT_uint32_t entries) {
+	DirectoryEntry* directory;
+	if(size > 0 && getDirSizeRoom(backing_disk, directory_id) < size) {
+		errno = EDQUOT;
+		return -1;
+	}
+	for(;;) {
+		directory = getEntryFromIndex(directory_id);
+		if(directory->max_entries != 0 && entries > 0 && directory->total_entries + entries > directory->max_entries) {
+			errno = EDQUOT;
+			return -1;
+		}
+		if(directory_id == ROOT_WORKING_DIRECTORY)
+			return 0;
+		directory_id = directory->parent_directory;
+	}
+}
+
+/*
+* Every change to the size of a file goes through here to keep the totals of its directories.
+*/
+static void setFileSize(FATBackingDisk* backing_disk, DirectoryEntry* entry, FAT_uint64_t new_size) {
+	updateDirTotals(backing_disk, entry->parent_directory, (FAT_int64_t)(new_size - entry->size), 0);
+	entry->size = new_size;
+}
+
+static void addChildToFolder(FATBackingDisk* backing_disk, FAT_uint16_t parent_id, FAT_uint16_t child) {
 	int i;
 	FAT_uint16_t* cur_child;
+	DirectoryEntry* parent = getEntryFromIndex(parent_id);
+	DirectoryEntry* child_entry = getEntryFromIndex(child);
 	for(i = 0; i < MAX_DIR_CHILDREN; ++i) {
 		cur_child = &(parent->children[i]);
 		if(*cur_child == FREE_CHILD_ENTRY || *cur_child == DELETED_CHILD_ENTRY) {
@@ -187,75 +873,210 @@ static void addChildToFolder(DirectoryEntry* parent, FAT_uint16_t child) {
 	}
 	assert(i < MAX_DIR_CHILDREN);
 	++(parent->num_children);
+	updateDirTotals(backing_disk, parent_id, (FAT_int64_t)child_entry->size, (FAT_int32_t)getEntryCount(child_entry));
 }
 
-static int initializeDirEntry(FATBackingDisk* backing_disk, int entry_id, const char* filename, DirectoryEntryType file_type) {
-	int new_fat_entry = 0;
-	DirectoryEntry* entry;
-	if(file_type != FAT_DIRECTORY) {
-		new_fat_entry = findFreeBlock(backing_disk);
-		if(new_fat_entry == -1)
-			return -1;
-		setNextFatEntry(new_fat_entry, LAST_FAT_ENTRY);
-	}
-	entry = getEntryFromIndex(entry_id);
+static DirectoryEntry* linkDirEntry(FATBackingDisk* backing_disk, int entry_id, const char* filename, DirectoryEntryType file_type, FAT_uint32_t first_fat_entry) {
+	DirectoryEntry* entry = getEntryFromIndex(entry_id);
 	strncpy(&entry->filename[0], filename, sizeof(entry->filename));
-	entry->first_fat_entry = (FAT_uint32_t)new_fat_entry;
+	invalidateNameIndex(backing_disk);
+	entry->first_fat_entry = first_fat_entry;
 	entry->size = 0;
+	entry->total_entries = 0;
+	entry->max_entries = 0;
+	entry->max_size = 0;
+	entry->flags = 0;
 	entry->file_type = (FAT_uint8_t)file_type;
 	entry->parent_directory = backing_disk->current_working_directory;
-	addChildToFolder(getEntryFromIndex(entry->parent_directory), (FAT_uint16_t)entry_id);
+	addChildToFolder(backing_disk, entry->parent_directory, (FAT_uint16_t)entry_id);
 	if(file_type == FAT_DIRECTORY) {
 		entry->num_children = 0;
 		memset(entry->children, 0, sizeof(entry->children));
 	}
+	return entry;
+}
+
+#define INLINE_DATA_SIZE (MAX_DIR_CHILDREN * sizeof(FAT_uint16_t))
+#define getInlineData(entry) ((char*)(entry)->children)
+
+/*
+* New files start inline, they get their first block once they grow past INLINE_DATA_SIZE.
+*/
+static int initializeDirEntry(FATBackingDisk* backing_disk, int entry_id, const char* filename, DirectoryEntryType file_type) {
+	DirectoryEntry* entry;
+	if(file_type == FAT_DIRECTORY) {
+		linkDirEntry(backing_disk, entry_id, filename, file_type, 0);
+		return 0;
+	}
+	entry = linkDirEntry(backing_disk, entry_id, filename, file_type, LAST_FAT_ENTRY);
+	entry->flags = FAT_FLAG_INLINE;
+	memset(getInlineData(entry), 0, INLINE_DATA_SIZE);
 	return 0;
 }
 
-Handle createFileFAT(FAT fat, const char* filename) {
+static int spillInlineFile(FATBackingDisk* backing_disk, DirectoryEntry* entry) {
+	FileBlock* block;
+	int new_fat_entry = findFreeBlock(backing_disk);
+	if(new_fat_entry == -1)
+		return -1;
+	setNextFatEntry(new_fat_entry, LAST_FAT_ENTRY);
+	block = getBlockFromIndex(new_fat_entry);
+	getHoleBlocks(new_fat_entry) = 0;
+	memcpy(block->buffer, getInlineData(entry), INLINE_DATA_SIZE);
+	memset(block->buffer + INLINE_DATA_SIZE, 0, sizeof(block->buffer) - INLINE_DATA_SIZE);
+	updateBlockChecksum(backing_disk, (FAT_uint32_t)new_fat_entry);
+	entry->first_fat_entry = (FAT_uint32_t)new_fat_entry;
+	entry->flags &= (FAT_uint8_t)~FAT_FLAG_INLINE;
+	return 0;
+}
+
+static void setupHandle(FileHandle* handle, FAT fat, int entry_id) {
+	handle->current_pos = 0;
+	handle->current_block_index = 0;
+	handle->directory_entry = (FAT_uint32_t)entry_id;
+	handle->backing_disk = fat;
+	handle->cluster_cache = NULL;
+	handle->cached_fat_entry = LAST_FAT_ENTRY;
+}
+
+/*
+* Takes a slot from the free list, adding a new chunk of slots to the table if there's none.
+*/
+static FileHandle* allocateHandle(FATBackingDisk* backing_disk) {
+	int descriptor;
+	FileHandle* handle;
+	FileHandle* chunk;
+	FileHandle** chunks;
+	HandleTable* table = &backing_disk->handles;
+	if(table->first_free == -1) {
+		chunks = (FileHandle**)realloc(table->chunks, (size_t)(table->total_chunks + 1) * sizeof(FileHandle*));
+		if(chunks == NULL)
+			return NULL;
+		table->chunks = chunks;
+		chunk = (FileHandle*)malloc(HANDLE_CHUNK_SIZE * sizeof(FileHandle));
+		if(chunk == NULL)
+			return NULL;
+		table->chunks[table->total_chunks++] = chunk;
+		for(descriptor = table->total_chunks * HANDLE_CHUNK_SIZE - 1; descriptor >= (table->total_chunks - 1) * HANDLE_CHUNK_SIZE; --descriptor) {
+			handle = getHandleSlot(table, descriptor);
+			handle->backing_disk = NULL;
+			handle->cluster_cache = NULL;
+			handle->descriptor = descriptor;
+			handle->next_free = table->first_free;
+			table->first_free = descriptor;
+		}
+	}
+	handle = getHandleSlot(table, table->first_free);
+	table->first_free = handle->next_free;
+	return handle;
+}
+
+/*
+* *created* is set to nonzero if the file didn't exist and was created.
+*/
+static int openFileFATUnlocked(FAT fat, const char* filename, int* created) {
 	int free_entry;
 	int used_entry;
 	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
 	FileHandle* handle;
+	*created = 0;
 	used_entry = findDirEntry(backing_disk, filename, &free_entry, FAT_FILE);
+	if(used_entry == -1 && backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
 	if(used_entry == -1 && free_entry == -1) {
 		errno = ENOSPC;
-		return NULL;
+		return -1;
 	}
-	handle = (FileHandle*)malloc(sizeof(FileHandle));
-	if(used_entry != -1) {
-		handle->current_pos = 0;
-		handle->current_block_index = 0;
-		handle->directory_entry = (FAT_uint32_t)used_entry;
-	} else {
+	if(used_entry == -1 && checkDirQuotas(backing_disk, backing_disk->current_working_directory, 0, 1) == -1)
+		return -1;
+	handle = allocateHandle(backing_disk);
+	if(handle == NULL)
+		return -1;
+	if(used_entry == -1) {
 		if(initializeDirEntry(backing_disk, free_entry, filename, FAT_FILE) == -1) {
-			free(handle);
+			releaseHandle(backing_disk, handle);
 			errno = ENOSPC;
-			return NULL;
+			return -1;
 		}
-		handle->current_pos = 0;
-		handle->current_block_index = 0;
-		handle->directory_entry = (FAT_uint32_t)free_entry;
+		used_entry = free_entry;
+		*created = 1;
+	}
+	setupHandle(handle, fat, used_entry);
+	return handle->descriptor;
+}
+
+Handle getHandleFAT(FAT fat, int descriptor) {
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	FileHandle* handle;
+	if(descriptor < 0 || descriptor >= backing_disk->handles.total_chunks * HANDLE_CHUNK_SIZE) {
+		errno = EBADF;
+		return NULL;
+	}
+	handle = getHandleSlot(&backing_disk->handles, descriptor);
+	if(handle->backing_disk == NULL) {
+		errno = EBADF;
+		return NULL;
 	}
-	handle->backing_disk = fat;
 	return handle;
 }
 
+static void traceClose(FATBackingDisk* backing_disk, int descriptor) {
+	TraceRecord record;
+	if(backing_disk->trace == NULL)
+		return;
+	record.operation = TRACE_CLOSE;
+	record.handle = descriptor;
+	record.mode = 0;
+	record.argument = 0;
+	record.argument2 = 0;
+	record.result = 0;
+	record.start = getTraceTime();
+	record.duration = 0;
+	record.name = NULL;
+	record.name2 = NULL;
+	writeTraceRecord(backing_disk->trace, &record);
+}
+
+int closeFileFAT(FAT fat, int descriptor) {
+	FileHandle* handle = (FileHandle*)getHandleFAT(fat, descriptor);
+	if(handle == NULL)
+		return -1;
+	traceClose((FATBackingDisk*)fat, descriptor);
+	releaseHandle((FATBackingDisk*)fat, handle);
+	return 0;
+}
+
+Handle createFileFAT(FAT fat, const char* filename) {
+	int descriptor = openFileFAT(fat, filename);
+	if(descriptor == -1)
+		return NULL;
+	return getHandleFAT(fat, descriptor);
+}
+
 void freeHandle(Handle handle) {
-	free(handle);
+	if(handle) {
+		traceClose((FATBackingDisk*)((FileHandle*)handle)->backing_disk, ((FileHandle*)handle)->descriptor);
+		releaseHandle((FATBackingDisk*)((FileHandle*)handle)->backing_disk, (FileHandle*)handle);
+	}
 }
 
 #define getBackingDiskFromHandle(handle) ((FATBackingDisk*)handle->backing_disk)
 #define getDirectoryEntryFromHandle(handle) getEntryFromIndex(handle->directory_entry)
 #define getFirstFatEntryFromDirectoryEntry(entry) (entry->first_fat_entry)
 
-static void removeChildFromFolder(DirectoryEntry* parent, FAT_uint16_t child) {
+static void removeChildFromFolder(FATBackingDisk* backing_disk, FAT_uint16_t parent_id, FAT_uint16_t child) {
 	int i;
 	FAT_uint16_t* cur_child;
+	DirectoryEntry* parent = getEntryFromIndex(parent_id);
+	DirectoryEntry* child_entry = getEntryFromIndex(child);
+	updateDirTotals(backing_disk, parent_id, -(FAT_int64_t)child_entry->size, -(FAT_int32_t)getEntryCount(child_entry));
 	for(i = 0; i < MAX_DIR_CHILDREN; ++i) {
 		cur_child = &(parent->children[i]);
 		if(*cur_child == child) {
 			*cur_child = DELETED_CHILD_ENTRY;
+			--(parent->num_children);
 			break;
 		}
 		if(*cur_child == FREE_CHILD_ENTRY)
@@ -263,309 +1084,2372 @@ static void removeChildFromFolder(DirectoryEntry* parent, FAT_uint16_t child) {
 	}
 }
 
-int eraseFileFAT(FAT fat, const char* filename) {
-	DirectoryEntry* entry;
-	FAT_uint32_t current_fat_entry;
-	FAT_uint32_t new_fat_entry;
-	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
-	int entry_id = findDirEntry(backing_disk, filename, NULL, FAT_FILE);
-	if(entry_id == -1) {
-		errno = ENOENT;
-		return -1;
+/*
+* Run of contiguous blocks freed while walking one or more chains, its backing
+* storage is given back to the host in a single call once the run can't be
+* extended anymore.
+*/
+typedef struct BlockRelease {
+	FAT_uint32_t run_start;
+	FAT_uint32_t run_length;
+} BlockRelease;
+
+static void flushBlockRelease(FATBackingDisk* backing_disk, BlockRelease* release) {
+	off_t offset;
+	off_t length;
+	if(release->run_length == 0)
+		return;
+	offset = (off_t)(offsetof(Disk, blocks) + release->run_start * sizeof(FileBlock));
+	length = (off_t)(release->run_length * sizeof(FileBlock));
+#ifdef FALLOC_FL_PUNCH_HOLE
+	/*
+	* Best effort, if the host filesystem doesn't support hole punching the
+	* blocks simply stay allocated as they were before.
+	*/
+	(void)fallocate(backing_disk->mmapped_file_descriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+#else
+	(void)backing_disk;
+	(void)offset;
+	(void)length;
+#endif
+	release->run_length = 0;
+}
+
+static void releaseBlock(FATBackingDisk* backing_disk, BlockRelease* release, FAT_uint32_t block_index) {
+	setNextFatEntry(block_index, UNUSED_FAT_ENTRY);
+	getHoleBlocks(block_index) = 0;
+	getBlockChecksum(block_index) = 0;
+	clearBlockVerified(block_index);
+	clearChecksumStale(block_index);
+	++(backing_disk->chain_generation);
+	if(block_index < backing_disk->counters->first_free_block)
+		backing_disk->counters->first_free_block = block_index;
+	if(release->run_length != 0) {
+		if(block_index == release->run_start + release->run_length) {
+			++(release->run_length);
+			return;
+		}
+		if(block_index + 1 == release->run_start) {
+			--(release->run_start);
+			++(release->run_length);
+			return;
+		}
+		flushBlockRelease(backing_disk, release);
 	}
-	entry = getEntryFromIndex(entry_id);
-	current_fat_entry = getFirstFatEntryFromDirectoryEntry(entry);
+	release->run_start = block_index;
+	release->run_length = 1;
+}
+
+static void freeFatChain(FATBackingDisk* backing_disk, BlockRelease* release, FAT_uint32_t current_fat_entry) {
+	FAT_uint32_t new_fat_entry;
 	while(current_fat_entry != LAST_FAT_ENTRY) {
 		assert(current_fat_entry != UNUSED_FAT_ENTRY);
+		/*
+		* The rest of the chain is still used by another file
+		*/
+		if(getBlockRefs(current_fat_entry) > 0) {
+			dropBlockRef(current_fat_entry);
+			++(backing_disk->chain_generation);
+			break;
+		}
 		new_fat_entry = getNextFatEntry(current_fat_entry);
-		setNextFatEntry(current_fat_entry, UNUSED_FAT_ENTRY);
+		releaseBlock(backing_disk, release, current_fat_entry);
 		current_fat_entry = new_fat_entry;
 	}
-	if(entry->parent_directory != ROOT_WORKING_DIRECTORY)
-		removeChildFromFolder(getEntryFromIndex(entry->parent_directory), (FAT_uint16_t)entry_id);
+}
+
+static void unlinkFileEntry(FATBackingDisk* backing_disk, BlockRelease* release, int entry_id) {
+	DirectoryEntry* entry = getEntryFromIndex(entry_id);
+	freeFatChain(backing_disk, release, getFirstFatEntryFromDirectoryEntry(entry));
+	removeChildFromFolder(backing_disk, entry->parent_directory, (FAT_uint16_t)entry_id);
 	memset(entry, 0, sizeof(DirectoryEntry));
+	invalidateNameIndex(backing_disk);
+}
+
+static void eraseFileEntry(FATBackingDisk* backing_disk, int entry_id) {
+	BlockRelease release = { 0, 0 };
+	unlinkFileEntry(backing_disk, &release, entry_id);
+	flushBlockRelease(backing_disk, &release);
+}
+
+static int eraseFileFATUnlocked(FAT fat, const char* filename) {
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	int entry_id;
+	if(backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	entry_id = findDirEntry(backing_disk, filename, NULL, FAT_FILE);
+	if(entry_id == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+	eraseFileEntry(backing_disk, entry_id);
 	return 0;
 }
 
-int eraseFileFATAt(Handle file) {
-	FAT_uint32_t current_fat_entry;
-	FAT_uint32_t new_fat_entry;
+static int eraseFileFATAtUnlocked(Handle file) {
 	FileHandle* handle = (FileHandle*)file;
-	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
-	DirectoryEntry* entry = getDirectoryEntryFromHandle(handle);
-	current_fat_entry = getFirstFatEntryFromDirectoryEntry(entry);
-	while(current_fat_entry != LAST_FAT_ENTRY) {
-		assert(current_fat_entry != UNUSED_FAT_ENTRY);
-		new_fat_entry = getNextFatEntry(current_fat_entry);
-		setNextFatEntry(current_fat_entry, UNUSED_FAT_ENTRY);
-		current_fat_entry = new_fat_entry;
+	if(getBackingDiskFromHandle(handle)->read_only) {
+		errno = EROFS;
+		return -1;
 	}
-	if(entry->parent_directory != ROOT_WORKING_DIRECTORY)
-		removeChildFromFolder(getEntryFromIndex(entry->parent_directory), (FAT_uint16_t)handle->directory_entry);
-	memset(entry, 0, sizeof(DirectoryEntry));
+	eraseFileEntry(getBackingDiskFromHandle(handle), (int)handle->directory_entry);
 	return 0;
 }
 
-static FileBlock* getCurrentBlockFromHandle(FileHandle* handle, FAT_uint32_t* return_fat_entry) {
-	FAT_uint32_t i;
-	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
-	DirectoryEntry* entry = getDirectoryEntryFromHandle(handle);
-	FAT_uint32_t current_fat_entry = getFirstFatEntryFromDirectoryEntry(entry);
-	for(i = 0; i < handle->current_block_index; i++) {
+static int cloneFileFATUnlocked(FAT fat, const char* src_filename, const char* dst_filename) {
+	int free_entry;
+	int src_entry_id;
+	DirectoryEntry* src_entry;
+	DirectoryEntry* dst_entry;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	if(backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	src_entry_id = findDirEntry(backing_disk, src_filename, NULL, FAT_FILE);
+	if(src_entry_id == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+	if(findDirEntry(backing_disk, dst_filename, &free_entry, FAT_FILE) != -1) {
+		errno = EEXIST;
+		return -1;
+	}
+	if(free_entry == -1) {
+		errno = ENOSPC;
+		return -1;
+	}
+	src_entry = getEntryFromIndex(src_entry_id);
+	if(checkDirQuotas(backing_disk, backing_disk->current_working_directory, src_entry->size, 1) == -1)
+		return -1;
+	dst_entry = linkDirEntry(backing_disk, free_entry, dst_filename, FAT_FILE, src_entry->first_fat_entry);
+	setFileSize(backing_disk, dst_entry, src_entry->size);
+	dst_entry->flags = src_entry->flags;
+	if(src_entry->flags & FAT_FLAG_INLINE)
+		memcpy(getInlineData(dst_entry), getInlineData(src_entry), INLINE_DATA_SIZE);
+	else
+		addBlockRef(src_entry->first_fat_entry);
+	return 0;
+}
+
+/*
+* Gives the file its own copy of every block up to the position last_block_index
+* that is currently shared with other files, since the FAT entries are shared as well,
+* a block can only be copied if all the ones preceding it are copied too.
+* Returns -1 if there's not enough space for the copies.
+*/
+static int unshareFileBlocks(FATBackingDisk* backing_disk, DirectoryEntry* entry, FAT_uint32_t last_block_index) {
+	FAT_uint32_t block_index;
+	int copied_fat_entry;
+	FAT_uint32_t* previous_link = &(entry->first_fat_entry);
+	FAT_uint32_t current_fat_entry = *previous_link;
+	block_index = 0;
+	while(current_fat_entry != LAST_FAT_ENTRY && block_index <= last_block_index) {
+		if(getBlockRefs(current_fat_entry) > 0) {
+			copied_fat_entry = findFreeBlock(backing_disk);
+			if(copied_fat_entry == -1)
+				return -1;
+			memcpy(getBlockFromIndex(copied_fat_entry), getBlockFromIndex(current_fat_entry), sizeof(FileBlock));
+			markBlockDirty(copied_fat_entry);
+			setNextFatEntry(copied_fat_entry, getNextFatEntry(current_fat_entry));
+			getHoleBlocks(copied_fat_entry) = getHoleBlocks(current_fat_entry);
+			getBlockChecksum(copied_fat_entry) = getBlockChecksum(current_fat_entry);
+			if(isBlockVerified(current_fat_entry))
+				markBlockVerified(copied_fat_entry);
+			else
+				clearBlockVerified(copied_fat_entry);
+			if(isChecksumStale(current_fat_entry))
+				markChecksumStale(copied_fat_entry);
+			else
+				clearChecksumStale(copied_fat_entry);
+			dropBlockRef(current_fat_entry);
+			if(getNextFatEntry(current_fat_entry) != LAST_FAT_ENTRY)
+				addBlockRef(getNextFatEntry(current_fat_entry));
+			++(backing_disk->chain_generation);
+			*previous_link = (FAT_uint32_t)copied_fat_entry;
+			current_fat_entry = (FAT_uint32_t)copied_fat_entry;
+		}
+		block_index += 1 + getHoleBlocks(current_fat_entry);
+		previous_link = &getNextFatEntry(current_fat_entry);
+		current_fat_entry = *previous_link;
+	}
+	return 0;
+}
+
+#define rotateLeft(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+/*
+* 4 independent lanes of multiply and rotate over the block, so that the
+* compiler can keep them in a single vector register.
+*/
+static FAT_uint32_t hashBlock(const FileBlock* block) {
+	FAT_uint32_t lanes[4] = { 0x9E3779B1UL, 0x85EBCA77UL, 0xC2B2AE3DUL, 0x27D4EB2FUL };
+	FAT_uint32_t words[4];
+	size_t i;
+	int j;
+	for(i = 0; i + sizeof(words) <= BLOCK_BUFFER_SIZE; i += sizeof(words)) {
+		memcpy(words, block->buffer + i, sizeof(words));
+		for(j = 0; j < 4; ++j) {
+			lanes[j] += words[j] * 0x85EBCA77UL;
+			lanes[j] = rotateLeft(lanes[j], 13);
+			lanes[j] *= 0x9E3779B1UL;
+		}
+	}
+	return rotateLeft(lanes[0], 1) + rotateLeft(lanes[1], 7) + rotateLeft(lanes[2], 12) + rotateLeft(lanes[3], 18);
+}
+
+#define DEDUP_INDEX_SIZE (TOTAL_BLOCKS * 2)
+
+typedef struct DedupIndex {
+	FAT_uint32_t hashes[DEDUP_INDEX_SIZE];
+	FAT_uint32_t blocks[DEDUP_INDEX_SIZE];
+	/*
+	* Block that each already scanned block got merged into (itself if it was kept),
+	* UNUSED_FAT_ENTRY if it wasn't scanned yet.
+	*/
+	FAT_uint32_t canonical[TOTAL_BLOCKS];
+	FAT_uint32_t path[TOTAL_BLOCKS];
+} DedupIndex;
+
+/*
+* Two blocks can be merged only if their FAT entries (and holes) are the same as well,
+* since chains are scanned from their tail, equal tails already point to the
+* same block by the time the blocks preceding them are looked up.
+*/
+static FAT_uint32_t findOrInsertDedupBlock(FATBackingDisk* backing_disk, DedupIndex* index, FAT_uint32_t block_index) {
+	FAT_uint32_t hash = hashBlock(getBlockFromIndex(block_index));
+	FAT_uint32_t slot = (hash ^ getNextFatEntry(block_index)) % DEDUP_INDEX_SIZE;
+	FAT_uint32_t candidate;
+	while((candidate = index->blocks[slot]) != UNUSED_FAT_ENTRY) {
+		if(index->hashes[slot] == hash &&
+		   getNextFatEntry(candidate) == getNextFatEntry(block_index) &&
+		   getHoleBlocks(candidate) == getHoleBlocks(block_index) &&
+		   memcmp(getBlockFromIndex(candidate), getBlockFromIndex(block_index), sizeof(FileBlock)) == 0)
+			return candidate;
+		slot = (slot + 1) % DEDUP_INDEX_SIZE;
+	}
+	index->hashes[slot] = hash;
+	index->blocks[slot] = block_index;
+	return block_index;
+}
+
+/*
+* Points the link (either a directory entry or a FAT entry) currently
+* referencing old_block to new_block, dropping the reference to old_block.
+*/
+static void relinkBlock(FATBackingDisk* backing_disk, BlockRelease* release, FAT_uint32_t* link, FAT_uint32_t new_block, DedupReport* report) {
+	FAT_uint32_t old_block = *link;
+	FAT_uint32_t free_blocks = 0;
+	*link = new_block;
+	addBlockRef(new_block);
+	++(backing_disk->chain_generation);
+	if(getBlockRefs(old_block) == 0)
+		free_blocks = 1;
+	freeFatChain(backing_disk, release, old_block);
+	report->shared_blocks += free_blocks;
+}
+
+static int dedupFATUnlocked(FAT fat, DedupReport* report) {
+	int i;
+	FAT_uint32_t path_length;
+	FAT_uint32_t current_fat_entry;
+	FAT_uint32_t merged_fat_entry;
+	FAT_uint32_t* link;
+	DirectoryEntry* entry;
+	DedupIndex* index;
+	BlockRelease release = { 0, 0 };
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	report->scanned_blocks = 0;
+	report->shared_blocks = 0;
+	report->saved_bytes = 0;
+	if(backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	index = (DedupIndex*)malloc(sizeof(DedupIndex));
+	if(index == NULL)
+		return -1;
+	memset(index->blocks, 0xff, sizeof(index->blocks));
+	memset(index->canonical, 0xff, sizeof(index->canonical));
+	for(i = 1; i < TOTAL_DIR_ENTRIES; ++i) {
+		entry = getEntryFromIndex(i);
+		if(entry->filename[0] == 0 || entry->file_type != FAT_FILE)
+			continue;
+		path_length = 0;
+		current_fat_entry = entry->first_fat_entry;
+		while(current_fat_entry != LAST_FAT_ENTRY && index->canonical[current_fat_entry] == UNUSED_FAT_ENTRY) {
+			index->path[path_length++] = current_fat_entry;
+			current_fat_entry = getNextFatEntry(current_fat_entry);
+		}
+		/*
+		* The rest of the chain was already scanned as part of another file
+		*/
+		if(current_fat_entry != LAST_FAT_ENTRY && index->canonical[current_fat_entry] != current_fat_entry) {
+			link = path_length == 0 ? &(entry->first_fat_entry) : &getNextFatEntry(index->path[path_length - 1]);
+			relinkBlock(backing_disk, &release, link, index->canonical[current_fat_entry], report);
+		}
+		while(path_length > 0) {
+			--path_length;
+			current_fat_entry = index->path[path_length];
+			++(report->scanned_blocks);
+			merged_fat_entry = findOrInsertDedupBlock(backing_disk, index, current_fat_entry);
+			index->canonical[current_fat_entry] = merged_fat_entry;
+			if(merged_fat_entry == current_fat_entry)
+				continue;
+			link = path_length == 0 ? &(entry->first_fat_entry) : &getNextFatEntry(index->path[path_length - 1]);
+			relinkBlock(backing_disk, &release, link, merged_fat_entry, report);
+		}
+	}
+	flushBlockRelease(backing_disk, &release);
+	free(index);
+	report->saved_bytes = (size_t)report->shared_blocks * sizeof(FileBlock);
+	return 0;
+}
+
+/*
+* Returns the last block of the file stored at or before the position block_index,
+* *found_block_index* is set to its position in the file, if it's lower than
+* block_index, the requested block is a hole.
+*/
+static FAT_uint32_t walkFileBlocks(FATBackingDisk* backing_disk, FAT_uint32_t current_fat_entry, FAT_uint32_t current_block_index, FAT_uint32_t block_index, FAT_uint32_t* found_block_index) {
+	assert(current_fat_entry != LAST_FAT_ENTRY);
+	while(getNextFatEntry(current_fat_entry) != LAST_FAT_ENTRY &&
+		  current_block_index + 1 + getHoleBlocks(current_fat_entry) <= block_index) {
 		assert(current_fat_entry != UNUSED_FAT_ENTRY);
-		if(current_fat_entry == LAST_FAT_ENTRY)
-			return NULL;
+		current_block_index += 1 + getHoleBlocks(current_fat_entry);
 		current_fat_entry = getNextFatEntry(current_fat_entry);
 	}
-	*return_fat_entry = current_fat_entry;
-	return getBlockFromIndex(current_fat_entry);
+	*found_block_index = current_block_index;
+	return current_fat_entry;
 }
 
-static FileBlock* getOrAllocateNewBlock(FATBackingDisk* backing_disk, FAT_uint32_t* current_fat_entry) {
-	FileBlock* new_block;
-	int new_block_index;
-	FAT_uint32_t next_fat_entry = getNextFatEntry(*current_fat_entry);
-	if(next_fat_entry != LAST_FAT_ENTRY) {
-		*current_fat_entry = next_fat_entry;
-		return getBlockFromIndex(next_fat_entry);
-	}
-	new_block_index = findFreeBlock(backing_disk);
-	if(new_block_index == -1)
-		return NULL;
-	setNextFatEntry(*current_fat_entry, new_block_index);
-	*current_fat_entry = (FAT_uint32_t)new_block_index;
-	setNextFatEntry(new_block_index, LAST_FAT_ENTRY);
-	new_block = getBlockFromIndex(new_block_index);
-	memset(new_block, 0, sizeof(new_block->buffer));
-	return new_block;
+#define findFileBlock(backing_disk, entry, block_index, found_block_index)\
+	walkFileBlocks(backing_disk, getFirstFatEntryFromDirectoryEntry(entry), 0, block_index, found_block_index)
+
+/*
+* Same as findFileBlock, starting from the block cached in the handle when possible.
+*/
+static FAT_uint32_t findHandleBlock(FileHandle* handle, DirectoryEntry* entry, FAT_uint32_t block_index, FAT_uint32_t* found_block_index) {
+	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
+	if(handle->cached_fat_entry != LAST_FAT_ENTRY && handle->cached_generation == backing_disk->chain_generation &&
+	   handle->cached_block_index <= block_index)
+		return walkFileBlocks(backing_disk, handle->cached_fat_entry, handle->cached_block_index, block_index, found_block_index);
+	return findFileBlock(backing_disk, entry, block_index, found_block_index);
+}
+
+#define cacheHandleBlock(handle, fat_entry, block_index)\
+do {\
+	handle->cached_fat_entry = fat_entry;\
+	handle->cached_block_index = block_index;\
+	handle->cached_generation = getBackingDiskFromHandle(handle)->chain_generation;\
+} while(0)
+
+/*
+* Moves to the block at the position block_index + 1 if it's stored.
+*/
+#define advanceToNextBlock(current_fat_entry, current_block_index, block_index)\
+do {\
+	if(getNextFatEntry(current_fat_entry) != LAST_FAT_ENTRY &&\
+	   current_block_index + 1 + getHoleBlocks(current_fat_entry) == block_index + 1) {\
+		current_fat_entry = getNextFatEntry(current_fat_entry);\
+		current_block_index = block_index + 1;\
+	}\
+} while(0)
+
+/*
+* Allocates a block for the hole at the position block_index, that comes after the
+* block previous_fat_entry at the position previous_block_index.
+* Returns LAST_FAT_ENTRY if there's no free block.
+*/
+static FAT_uint32_t fillHole(FATBackingDisk* backing_disk, FAT_uint32_t previous_fat_entry, FAT_uint32_t previous_block_index, FAT_uint32_t block_index) {
+	int new_fat_entry = findFreeBlock(backing_disk);
+	FAT_uint32_t next_fat_entry = getNextFatEntry(previous_fat_entry);
+	if(new_fat_entry == -1)
+		return LAST_FAT_ENTRY;
+	memset(getBlockFromIndex(new_fat_entry), 0, sizeof(FileBlock));
+	markBlockDirty(new_fat_entry);
+	setNextFatEntry(new_fat_entry, next_fat_entry);
+	if(next_fat_entry == LAST_FAT_ENTRY)
+		getHoleBlocks(new_fat_entry) = 0;
+	else
+		getHoleBlocks(new_fat_entry) = previous_block_index + getHoleBlocks(previous_fat_entry) - block_index;
+	getHoleBlocks(previous_fat_entry) = block_index - previous_block_index - 1;
+	setNextFatEntry(previous_fat_entry, new_fat_entry);
+	return (FAT_uint32_t)new_fat_entry;
 }
 
-#define getAbsolutePosFromHandle(handle) ((handle->current_block_index * BLOCK_BUFFER_SIZE) + handle->current_pos)
+#define getAbsolutePosFromHandle(handle) (((FAT_uint64_t)handle->current_block_index * BLOCK_BUFFER_SIZE) + handle->current_pos)
 #define getTotalSizeFromHandle(handle) (getDirectoryEntryFromHandle(handle)->size)
 
 #define updateFileHandlePositionFromAbsolutePosition(handle, absolute_pos)\
 do {\
-	handle->current_block_index = absolute_pos / BLOCK_BUFFER_SIZE;\
-	handle->current_pos = absolute_pos % BLOCK_BUFFER_SIZE;\
+	handle->current_block_index = (FAT_uint32_t)(absolute_pos / BLOCK_BUFFER_SIZE);\
+	handle->current_pos = (FAT_uint32_t)(absolute_pos % BLOCK_BUFFER_SIZE);\
 } while(0)
 
-#define doFileNeedNewBlock(handle) (handle->current_pos == BLOCK_BUFFER_SIZE + 1)
+/*
+* Appends data to a chain that is being built, allocating its blocks as needed.
+*/
+typedef struct ChainWriter {
+	FAT_uint32_t first_fat_entry;
+	FAT_uint32_t current_fat_entry;
+	FAT_uint32_t pos;
+} ChainWriter;
+
+#define initChainWriter(writer)\
+do {\
+	(writer)->first_fat_entry = LAST_FAT_ENTRY;\
+	(writer)->current_fat_entry = LAST_FAT_ENTRY;\
+	(writer)->pos = BLOCK_BUFFER_SIZE;\
+} while(0)
 
-FileBlock* allocateNewBlockForHandleFromENOSPCState(FileHandle* handle, FAT_uint32_t* return_fat_entry) {
-	FileBlock* current_block;
-	--(handle->current_block_index);
-	current_block = getCurrentBlockFromHandle(handle, return_fat_entry);
-	assert(current_block != NULL);
-	++(handle->current_block_index);
-	if((current_block = getOrAllocateNewBlock(getBackingDiskFromHandle(handle), return_fat_entry)) == NULL) {
+static int appendChainBlock(FATBackingDisk* backing_disk, ChainWriter* writer) {
+	int new_block_index = findFreeBlock(backing_disk);
+	if(new_block_index == -1) {
 		errno = ENOSPC;
-		return NULL;
+		return -1;
 	}
-	handle->current_pos = 0;
-	return current_block;
+	setNextFatEntry(new_block_index, LAST_FAT_ENTRY);
+	if(writer->current_fat_entry == LAST_FAT_ENTRY)
+		writer->first_fat_entry = (FAT_uint32_t)new_block_index;
+	else
+		setNextFatEntry(writer->current_fat_entry, new_block_index);
+	writer->current_fat_entry = (FAT_uint32_t)new_block_index;
+	writer->pos = 0;
+	getHoleBlocks(new_block_index) = 0;
+	memset(getBlockFromIndex(new_block_index), 0, sizeof(FileBlock));
+	markBlockDirty(new_block_index);
+	return 0;
 }
 
-int writeFAT(Handle to, const void* in, size_t size) {
-	FAT_uint32_t current_fat_entry;
-	FileHandle* handle = (FileHandle*)to;
-	size_t written = 0;
-	FAT_uint32_t pos;
-	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
-	FAT_uint32_t absolute_pos;
-	FileBlock* block = getCurrentBlockFromHandle(handle, &current_fat_entry);
-	const char* cur = (const char*)in;
+static int appendToChain(FATBackingDisk* backing_disk, ChainWriter* writer, const char* data, size_t size) {
 	size_t to_write;
-	FAT_uint32_t iterated_blocks = 0;
-	if(doFileNeedNewBlock(handle)) {
-		if((block = allocateNewBlockForHandleFromENOSPCState(handle, &current_fat_entry)) == NULL) {
-			errno = ENOSPC;
-			return 0;
+	while(size > 0) {
+		if(writer->pos == BLOCK_BUFFER_SIZE && appendChainBlock(backing_disk, writer) != 0)
+			return -1;
+		to_write = BLOCK_BUFFER_SIZE - writer->pos;
+		if(to_write > size)
+			to_write = size;
+		memcpy(getBlockFromIndex(writer->current_fat_entry)->buffer + writer->pos, data, to_write);
+		updateBlockChecksum(backing_disk, writer->current_fat_entry);
+		writer->pos += to_write;
+		data += to_write;
+		size -= to_write;
+	}
+	return 0;
+}
+
+static int copyChainBytes(FATBackingDisk* backing_disk, FAT_uint32_t current_fat_entry, FAT_uint32_t offset, void* buffer, size_t size, int to_chain) {
+	size_t to_copy;
+	char* cur = (char*)buffer;
+	for(; offset >= BLOCK_BUFFER_SIZE; offset -= BLOCK_BUFFER_SIZE)
+		current_fat_entry = getNextFatEntry(current_fat_entry);
+	while(size > 0) {
+		assert(current_fat_entry != LAST_FAT_ENTRY && current_fat_entry != UNUSED_FAT_ENTRY);
+		to_copy = BLOCK_BUFFER_SIZE - offset;
+		if(to_copy > size)
+			to_copy = size;
+		if(to_chain) {
+			memcpy(getBlockFromIndex(current_fat_entry)->buffer + offset, cur, to_copy);
+			updateBlockChecksum(backing_disk, current_fat_entry);
+		} else {
+			if(verifyBlockChecksum(backing_disk, current_fat_entry) != 0)
+				return -1;
+			memcpy(cur, getBlockFromIndex(current_fat_entry)->buffer + offset, to_copy);
 		}
+		cur += to_copy;
+		size -= to_copy;
+		offset = 0;
+		current_fat_entry = getNextFatEntry(current_fat_entry);
 	}
-	pos = handle->current_pos;
-	absolute_pos = getAbsolutePosFromHandle(handle);
-	while(written < size) {
-		to_write = BLOCK_BUFFER_SIZE - pos;
-		if(to_write > (size - written))
-			to_write = size - written;
-		memcpy(block->buffer + pos, cur, to_write);
-		pos += to_write;
-		absolute_pos += to_write;
-		cur += to_write;
-		written += to_write;
-		if(pos >= BLOCK_BUFFER_SIZE) {
-			pos %= BLOCK_BUFFER_SIZE;
-			++iterated_blocks;
-			if((block = getOrAllocateNewBlock(backing_disk, &current_fat_entry)) == NULL) {
-				pos = BLOCK_BUFFER_SIZE + 1;
-				break;
-			}
+	return 0;
+}
+
+#define getClusterSize(entry, cluster)\
+	((FAT_uint32_t)((entry)->size - (cluster) * COMPRESSION_CLUSTER_SIZE < COMPRESSION_CLUSTER_SIZE ?\
+	 (entry)->size - (cluster) * COMPRESSION_CLUSTER_SIZE : COMPRESSION_CLUSTER_SIZE))
+
+/*
+* Clusters that couldn't be compressed are stored as they are, they're
+* recognizable by their stored size being the same as their real size.
+*/
+static int loadCluster(FATBackingDisk* backing_disk, DirectoryEntry* entry, FAT_uint32_t cluster, ClusterCache* cache) {
+	FAT_uint32_t bounds[2];
+	FAT_uint32_t stored_size;
+	FAT_uint32_t cluster_size = getClusterSize(entry, cluster);
+	if(copyChainBytes(backing_disk, entry->first_fat_entry, cluster * sizeof(FAT_uint32_t), bounds, sizeof(bounds), 0) != 0)
+		return -1;
+	stored_size = bounds[1] - bounds[0];
+	if(stored_size == cluster_size) {
+		if(copyChainBytes(backing_disk, entry->first_fat_entry, bounds[0], cache->data, cluster_size, 0) != 0)
+			return -1;
+	} else {
+		if(stored_size > cluster_size) {
+			errno = EIO;
+			return -1;
+		}
+		if(copyChainBytes(backing_disk, entry->first_fat_entry, bounds[0], cache->compressed, stored_size, 0) != 0)
+			return -1;
+		if(decompressBuffer(cache->compressed, stored_size, cache->data, cluster_size) != 0) {
+			errno = EIO;
+			return -1;
 		}
 	}
-	handle->current_pos = pos;
-	handle->current_block_index += iterated_blocks;
-	if(absolute_pos > getTotalSizeFromHandle(handle))
-		getTotalSizeFromHandle(handle) = absolute_pos;
-	return (int)written;
+	cache->cluster = cluster;
+	cache->generation = backing_disk->compression_generation;
+	return 0;
 }
 
-int readFAT(Handle from, void* out, size_t size) {
-	FAT_uint32_t current_fat_entry;
-	FileHandle* handle = (FileHandle*)from;
-	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
-	FAT_uint32_t absolute_pos;
-	FAT_uint32_t file_size = getTotalSizeFromHandle(handle);
-	FAT_uint32_t total_read = 0;
-	FileBlock* block = getCurrentBlockFromHandle(handle, &current_fat_entry);
-	char* cur = (char*)out;
+static FAT_int64_t readCompressedFAT(FileHandle* handle, char* out, size_t size) {
+	FAT_uint32_t cluster;
+	FAT_uint32_t cluster_pos;
 	size_t to_read;
-	FAT_uint32_t iterated_blocks = 0;
-	FAT_uint32_t pos;
-	if(doFileNeedNewBlock(handle)) {
-		if((block = allocateNewBlockForHandleFromENOSPCState(handle, &current_fat_entry)) == NULL) {
-			errno = ENOSPC;
+	size_t total_read = 0;
+	ClusterCache* cache;
+	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
+	DirectoryEntry* entry = getDirectoryEntryFromHandle(handle);
+	FAT_uint64_t absolute_pos = getAbsolutePosFromHandle(handle);
+	if(absolute_pos >= entry->size)
+		return 0;
+	if(size > entry->size - absolute_pos)
+		size = (size_t)(entry->size - absolute_pos);
+	if(handle->cluster_cache == NULL) {
+		if((handle->cluster_cache = (ClusterCache*)malloc(sizeof(ClusterCache))) == NULL)
 			return -1;
-		}
+		handle->cluster_cache->cluster = UNUSED_FAT_ENTRY;
 	}
-	pos = handle->current_pos;
-	absolute_pos = getAbsolutePosFromHandle(handle);
-	if((absolute_pos + size) > file_size)
-		size = file_size - absolute_pos;
+	cache = handle->cluster_cache;
 	while(total_read < size) {
-		to_read = BLOCK_BUFFER_SIZE - pos;
-		if(to_read > (size - total_read))
-			to_read = size - total_read;
-		memcpy(cur, block->buffer + pos, to_read);
-		pos += to_read;
-		absolute_pos += to_read;
-		cur += to_read;
-		total_read += to_read;
-		if(pos == BLOCK_BUFFER_SIZE) {
-			pos = 0;
-			++iterated_blocks;
-			if((block = getOrAllocateNewBlock(backing_disk, &current_fat_entry)) == NULL) {
-				pos = BLOCK_BUFFER_SIZE + 1;
+		cluster = (FAT_uint32_t)(absolute_pos / COMPRESSION_CLUSTER_SIZE);
+		if(cache->cluster != cluster || cache->generation != backing_disk->compression_generation) {
+			if(loadCluster(backing_disk, entry, cluster, cache) != 0) {
+				cache->cluster = UNUSED_FAT_ENTRY;
 				break;
 			}
 		}
+		cluster_pos = (FAT_uint32_t)(absolute_pos % COMPRESSION_CLUSTER_SIZE);
+		to_read = COMPRESSION_CLUSTER_SIZE - cluster_pos;
+		if(to_read > size - total_read)
+			to_read = size - total_read;
+		memcpy(out + total_read, cache->data + cluster_pos, to_read);
+		total_read += to_read;
+		absolute_pos += to_read;
 	}
-	handle->current_pos = pos;
-	handle->current_block_index += iterated_blocks;
-	return (int)total_read;
+	updateFileHandlePositionFromAbsolutePosition(handle, absolute_pos);
+	if(total_read == 0 && size > 0)
+		return -1;
+	return (FAT_int64_t)total_read;
 }
 
-int seekFAT(Handle file, FAT_int32_t offset, SeekWhence whence) {
-	FAT_uint32_t new_pos;
-	FileHandle* handle = (FileHandle*)file;
-	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
-	if(whence > FAT_SEEK_END)
+/*
+* Converts a compressed file back to a regular one.
+*/
+static int inflateFileEntry(FATBackingDisk* backing_disk, DirectoryEntry* entry) {
+	FAT_uint32_t cluster;
+	ChainWriter writer;
+	BlockRelease release = { 0, 0 };
+	ClusterCache* cache = (ClusterCache*)malloc(sizeof(ClusterCache));
+	if(cache == NULL)
 		return -1;
-	switch(whence) {
-		case FAT_SEEK_SET:
-			if(offset < 0)
-				return -1;
-			new_pos = offset;
-			break;
-		case FAT_SEEK_CUR: {
-			new_pos = getAbsolutePosFromHandle(handle) + (FAT_int32_t)offset;
-			if(new_pos > getTotalSizeFromHandle(handle))
-				return -1;
-			break;
-		}
-		case FAT_SEEK_END: {
-			if(offset > 0)
-				return -1;
-			new_pos = getTotalSizeFromHandle(handle);
-			new_pos += offset;
-			/*underflow*/
-			if(new_pos > getTotalSizeFromHandle(handle))
-				return -1;
-			break;
-		}
+	initChainWriter(&writer);
+	for(cluster = 0; (FAT_uint64_t)cluster * COMPRESSION_CLUSTER_SIZE < entry->size; ++cluster) {
+		if(loadCluster(backing_disk, entry, cluster, cache) != 0 ||
+		   appendToChain(backing_disk, &writer, cache->data, getClusterSize(entry, cluster)) != 0)
+			goto error;
 	}
-	updateFileHandlePositionFromAbsolutePosition(handle, (FAT_uint32_t)new_pos);
+	freeFatChain(backing_disk, &release, entry->first_fat_entry);
+	flushBlockRelease(backing_disk, &release);
+	entry->first_fat_entry = writer.first_fat_entry;
+	entry->flags &= (FAT_uint8_t)~FAT_FLAG_COMPRESSED;
+	++(backing_disk->compression_generation);
+	free(cache);
 	return 0;
+error:
+	freeFatChain(backing_disk, &release, writer.first_fat_entry);
+	flushBlockRelease(backing_disk, &release);
+	free(cache);
+	return -1;
 }
 
-int createDirFAT(FAT fat, const char* dirname) {
-	int free_entry;
-	int used_entry;
+static int compressFileFATUnlocked(FAT fat, const char* filename) {
+	int entry_id;
+	FAT_uint32_t cluster;
+	FAT_uint32_t cluster_count;
+	FAT_uint32_t cluster_size;
+	size_t stored_size;
+	size_t offsets_size;
+	FAT_uint32_t* offsets;
+	ClusterCache* cache;
+	DirectoryEntry* entry;
+	FileHandle reader;
+	ChainWriter writer;
+	BlockRelease release = { 0, 0 };
 	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
-	used_entry = findDirEntry(backing_disk, dirname, &free_entry, FAT_DIRECTORY);
-	if(free_entry == -1 && used_entry == -1) {
-		errno = ENOSPC;
+	if(backing_disk->read_only) {
+		errno = EROFS;
 		return -1;
 	}
-	if(used_entry != -1)
-		return 0;
+	entry_id = findDirEntry(backing_disk, filename, NULL, FAT_FILE);
+	if(entry_id == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+	entry = getEntryFromIndex(entry_id);
+	if((entry->flags & (FAT_FLAG_COMPRESSED | FAT_FLAG_INLINE)) || entry->size == 0 || entry->size > MAX_COMPRESSED_FILE_SIZE)
+		return 0;
+	cluster_count = (FAT_uint32_t)((entry->size + COMPRESSION_CLUSTER_SIZE - 1) / COMPRESSION_CLUSTER_SIZE);
+	offsets_size = (cluster_count + 1) * sizeof(FAT_uint32_t);
+	offsets = (FAT_uint32_t*)calloc(cluster_count + 1, sizeof(FAT_uint32_t));
+	cache = (ClusterCache*)malloc(sizeof(ClusterCache));
+	if(offsets == NULL || cache == NULL) {
+		free(offsets);
+		free(cache);
+		return -1;
+	}
+	setupHandle(&reader, fat, entry_id);
+	initChainWriter(&writer);
+	/*
+	* Room for the offsets, they're filled once all the clusters are compressed
+	*/
+	if(appendToChain(backing_disk, &writer, (const char*)offsets, offsets_size) != 0)
+		goto error;
+	offsets[0] = (FAT_uint32_t)offsets_size;
+	for(cluster = 0; cluster < cluster_count; ++cluster) {
+		cluster_size = getClusterSize(entry, cluster);
+		if(readFAT64Unlocked(&reader, cache->data, cluster_size) != (FAT_int64_t)cluster_size)
+			goto error;
+		stored_size = compressBuffer(cache->data, cluster_size, cache->compressed, cluster_size - 1);
+		if(stored_size == 0) {
+			stored_size = cluster_size;
+			if(appendToChain(backing_disk, &writer, cache->data, stored_size) != 0)
+				goto error;
+		} else if(appendToChain(backing_disk, &writer, cache->compressed, stored_size) != 0)
+			goto error;
+		offsets[cluster + 1] = offsets[cluster] + (FAT_uint32_t)stored_size;
+	}
+	/*
+	* Not worth it, the compressed file would use as many blocks as the regular one
+	*/
+	if((offsets[cluster_count] + BLOCK_BUFFER_SIZE - 1) / BLOCK_BUFFER_SIZE >= (entry->size + BLOCK_BUFFER_SIZE - 1) / BLOCK_BUFFER_SIZE) {
+		freeFatChain(backing_disk, &release, writer.first_fat_entry);
+		flushBlockRelease(backing_disk, &release);
+		free(offsets);
+		free(cache);
+		return 0;
+	}
+	copyChainBytes(backing_disk, writer.first_fat_entry, 0, offsets, offsets_size, 1);
+	freeFatChain(backing_disk, &release, entry->first_fat_entry);
+	flushBlockRelease(backing_disk, &release);
+	entry->first_fat_entry = writer.first_fat_entry;
+	entry->flags |= FAT_FLAG_COMPRESSED;
+	++(backing_disk->compression_generation);
+	free(offsets);
+	free(cache);
+	return 0;
+error:
+	freeFatChain(backing_disk, &release, writer.first_fat_entry);
+	flushBlockRelease(backing_disk, &release);
+	free(offsets);
+	free(cache);
+	return -1;
+}
+
+static FAT_int64_t writeInlineFAT(FileHandle* handle, const void* in, size_t size) {
+	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
+	DirectoryEntry* entry = getDirectoryEntryFromHandle(handle);
+	FAT_uint64_t absolute_pos = getAbsolutePosFromHandle(handle);
+	memcpy(getInlineData(entry) + absolute_pos, in, size);
+	absolute_pos += size;
+	updateFileHandlePositionFromAbsolutePosition(handle, absolute_pos);
+	if(absolute_pos > entry->size)
+		setFileSize(backing_disk, entry, absolute_pos);
+	return (FAT_int64_t)size;
+}
+
+static FAT_int64_t readInlineFAT(FileHandle* handle, void* out, size_t size) {
+	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
+	DirectoryEntry* entry = getDirectoryEntryFromHandle(handle);
+	FAT_uint64_t absolute_pos = getAbsolutePosFromHandle(handle);
+	if(absolute_pos >= entry->size)
+		return 0;
+	if(size > entry->size - absolute_pos)
+		size = (size_t)(entry->size - absolute_pos);
+	memcpy(out, getInlineData(entry) + absolute_pos, size);
+	absolute_pos += size;
+	updateFileHandlePositionFromAbsolutePosition(handle, absolute_pos);
+	return (FAT_int64_t)size;
+}
+
+static FAT_int64_t writeFAT64Unlocked(Handle to, const void* in, size_t size) {
+	FAT_uint32_t current_fat_entry;
+	FAT_uint32_t current_block_index;
+	FileHandle* handle = (FileHandle*)to;
+	size_t written = 0;
+	FAT_uint32_t pos;
+	FAT_uint32_t block_index;
+	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
+	FAT_uint64_t absolute_pos = getAbsolutePosFromHandle(handle);
+	DirectoryEntry* entry = getDirectoryEntryFromHandle(handle);
+	const char* cur = (const char*)in;
+	size_t to_write;
+	FAT_uint64_t room;
+	if(backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	if(absolute_pos >= MAX_FILE_SIZE && size > 0) {
+		errno = EFBIG;
+		return 0;
+	}
+	if(size > MAX_FILE_SIZE - absolute_pos)
+		size = (size_t)(MAX_FILE_SIZE - absolute_pos);
+	/*
+	* Like for the maximum size, the write stops at the quota of the directories
+	*/
+	if(absolute_pos + size > entry->size) {
+		room = getDirSizeRoom(backing_disk, entry->parent_directory);
+		if(absolute_pos >= entry->size + room && size > 0) {
+			errno = EDQUOT;
+			return 0;
+		}
+		if(absolute_pos + size - entry->size > room) {
+			size = (size_t)(entry->size + room - absolute_pos);
+			errno = EDQUOT;
+		}
+	}
+	if(entry->flags & FAT_FLAG_INLINE) {
+		if(absolute_pos <= INLINE_DATA_SIZE && size <= INLINE_DATA_SIZE - absolute_pos)
+			return writeInlineFAT(handle, in, size);
+		if(spillInlineFile(backing_disk, entry) != 0) {
+			errno = ENOSPC;
+			return 0;
+		}
+	}
+	if((entry->flags & FAT_FLAG_COMPRESSED) && inflateFileEntry(backing_disk, entry) != 0)
+		return 0;
+	pos = handle->current_pos;
+	block_index = handle->current_block_index;
+	if(backing_disk->counters->shared_refs > 0 &&
+	   unshareFileBlocks(backing_disk, entry, block_index + (FAT_uint32_t)((pos + size) / BLOCK_BUFFER_SIZE)) == -1) {
+		errno = ENOSPC;
+		return 0;
+	}
+	current_fat_entry = findHandleBlock(handle, entry, block_index, &current_block_index);
+	while(written < size) {
+		if(current_block_index != block_index) {
+			current_fat_entry = fillHole(backing_disk, current_fat_entry, current_block_index, block_index);
+			if(current_fat_entry == LAST_FAT_ENTRY) {
+				errno = ENOSPC;
+				break;
+			}
+			current_block_index = block_index;
+		}
+		to_write = BLOCK_BUFFER_SIZE - pos;
+		if(to_write > (size - written))
+			to_write = size - written;
+		memcpy(getBlockFromIndex(current_fat_entry)->buffer + pos, cur, to_write);
+		updateBlockChecksum(backing_disk, current_fat_entry);
+		pos += to_write;
+		cur += to_write;
+		written += to_write;
+		if(pos == BLOCK_BUFFER_SIZE) {
+			pos = 0;
+			advanceToNextBlock(current_fat_entry, current_block_index, block_index);
+			++block_index;
+		}
+	}
+	handle->current_pos = pos;
+	handle->current_block_index = block_index;
+	cacheHandleBlock(handle, current_fat_entry, current_block_index);
+	absolute_pos = getAbsolutePosFromHandle(handle);
+	if(absolute_pos > entry->size)
+		setFileSize(backing_disk, entry, absolute_pos);
+	return (FAT_int64_t)written;
+}
+
+int writeFAT(Handle to, const void* in, size_t size) {
+	if(size > INT_MAX)
+		size = INT_MAX;
+	return (int)writeFAT64(to, in, size);
+}
+
+static FAT_int64_t readFAT64Unlocked(Handle from, void* out, size_t size) {
+	FAT_uint32_t current_fat_entry;
+	FAT_uint32_t current_block_index;
+	FileHandle* handle = (FileHandle*)from;
+	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
+	DirectoryEntry* entry = getDirectoryEntryFromHandle(handle);
+	FAT_uint64_t absolute_pos;
+	FAT_uint64_t file_size = entry->size;
+	size_t total_read = 0;
+	char* cur = (char*)out;
+	size_t to_read;
+	FAT_uint32_t pos;
+	FAT_uint32_t block_index;
+	if(entry->flags & FAT_FLAG_INLINE)
+		return readInlineFAT(handle, cur, size);
+	if(entry->flags & FAT_FLAG_COMPRESSED)
+		return readCompressedFAT(handle, cur, size);
+	pos = handle->current_pos;
+	block_index = handle->current_block_index;
+	absolute_pos = getAbsolutePosFromHandle(handle);
+	if(absolute_pos >= file_size)
+		return 0;
+	if(size > file_size - absolute_pos)
+		size = (size_t)(file_size - absolute_pos);
+	current_fat_entry = findHandleBlock(handle, entry, block_index, &current_block_index);
+	while(total_read < size) {
+		to_read = BLOCK_BUFFER_SIZE - pos;
+		if(to_read > (size - total_read))
+			to_read = size - total_read;
+		if(current_block_index == block_index) {
+			if(verifyBlockChecksum(backing_disk, current_fat_entry) != 0)
+				break;
+			memcpy(cur, getBlockFromIndex(current_fat_entry)->buffer + pos, to_read);
+		} else {
+			memset(cur, 0, to_read);
+		}
+		pos += to_read;
+		cur += to_read;
+		total_read += to_read;
+		if(pos == BLOCK_BUFFER_SIZE) {
+			pos = 0;
+			advanceToNextBlock(current_fat_entry, current_block_index, block_index);
+			++block_index;
+		}
+	}
+	handle->current_pos = pos;
+	handle->current_block_index = block_index;
+	cacheHandleBlock(handle, current_fat_entry, current_block_index);
+	if(total_read == 0 && size > 0)
+		return -1;
+	return (FAT_int64_t)total_read;
+}
+
+int readFAT(Handle from, void* out, size_t size) {
+	if(size > INT_MAX)
+		size = INT_MAX;
+	return (int)readFAT64(from, out, size);
+}
+
+/*
+* The handle keeps the block reached by each transfer, so the following
+* one starts from there instead of walking the chain again.
+*/
+static FAT_int64_t readvFATUnlocked(Handle from, const IoVector* vectors, int count) {
+	int i;
+	FAT_int64_t read;
+	FAT_int64_t total_read = 0;
+	for(i = 0; i < count; ++i) {
+		read = readFAT64Unlocked(from, vectors[i].base, vectors[i].length);
+		if(read < 0)
+			return total_read > 0 ? total_read : -1;
+		total_read += read;
+		if((size_t)read != vectors[i].length)
+			break;
+	}
+	return total_read;
+}
+
+static FAT_int64_t writevFATUnlocked(Handle to, const IoVector* vectors, int count) {
+	int i;
+	FAT_int64_t written;
+	FAT_int64_t total_written = 0;
+	for(i = 0; i < count; ++i) {
+		written = writeFAT64Unlocked(to, vectors[i].base, vectors[i].length);
+		if(written < 0)
+			return total_written > 0 ? total_written : -1;
+		total_written += written;
+		if((size_t)written != vectors[i].length)
+			break;
+	}
+	return total_written;
+}
+
+/*
+* Files that are stored inline or compressed have no holes.
+*/
+static int seekDataOrHole(FileHandle* handle, FAT_uint64_t offset, SeekWhence whence, FAT_uint64_t* new_pos) {
+	FAT_uint32_t current_fat_entry;
+	FAT_uint32_t current_block_index;
+	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
+	DirectoryEntry* entry = getDirectoryEntryFromHandle(handle);
+	FAT_uint32_t block_index = (FAT_uint32_t)(offset / BLOCK_BUFFER_SIZE);
+	if(offset >= entry->size) {
+		errno = ENXIO;
+		return -1;
+	}
+	if(entry->flags & (FAT_FLAG_INLINE | FAT_FLAG_COMPRESSED)) {
+		*new_pos = whence == FAT_SEEK_DATA ? offset : entry->size;
+		return 0;
+	}
+	current_fat_entry = findFileBlock(backing_disk, entry, block_index, &current_block_index);
+	if(whence == FAT_SEEK_DATA) {
+		if(current_block_index == block_index) {
+			*new_pos = offset;
+			return 0;
+		}
+		if(getNextFatEntry(current_fat_entry) == LAST_FAT_ENTRY)
+			*new_pos = entry->size;
+		else
+			*new_pos = (FAT_uint64_t)(current_block_index + 1 + getHoleBlocks(current_fat_entry)) * BLOCK_BUFFER_SIZE;
+		if(*new_pos >= entry->size) {
+			errno = ENXIO;
+			return -1;
+		}
+		return 0;
+	}
+	if(current_block_index != block_index) {
+		*new_pos = offset;
+		return 0;
+	}
+	while(getHoleBlocks(current_fat_entry) == 0 && getNextFatEntry(current_fat_entry) != LAST_FAT_ENTRY) {
+		current_fat_entry = getNextFatEntry(current_fat_entry);
+		++current_block_index;
+	}
+	*new_pos = (FAT_uint64_t)(current_block_index + 1) * BLOCK_BUFFER_SIZE;
+	if(*new_pos > entry->size)
+		*new_pos = entry->size;
+	return 0;
+}
+
+static int seekFAT64Unlocked(Handle file, FAT_int64_t offset, SeekWhence whence) {
+	FAT_uint64_t new_pos;
+	FAT_uint64_t current_pos;
+	FileHandle* handle = (FileHandle*)file;
+	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
+	switch(whence) {
+		case FAT_SEEK_SET:
+			if(offset < 0)
+				return -1;
+			new_pos = (FAT_uint64_t)offset;
+			break;
+		case FAT_SEEK_CUR: {
+			current_pos = getAbsolutePosFromHandle(handle);
+			new_pos = current_pos + (FAT_uint64_t)offset;
+			/*underflow or overflow*/
+			if((offset < 0 && new_pos > current_pos) || (offset > 0 && new_pos < current_pos))
+				return -1;
+			break;
+		}
+		case FAT_SEEK_END: {
+			if(offset > 0)
+				return -1;
+			new_pos = getTotalSizeFromHandle(handle);
+			new_pos += (FAT_uint64_t)offset;
+			/*underflow*/
+			if(new_pos > getTotalSizeFromHandle(handle))
+				return -1;
+			break;
+		}
+		case FAT_SEEK_DATA:
+		case FAT_SEEK_HOLE: {
+			if(offset < 0) {
+				errno = ENXIO;
+				return -1;
+			}
+			if(seekDataOrHole(handle, (FAT_uint64_t)offset, whence, &new_pos) != 0)
+				return -1;
+			break;
+		}
+		default:
+			return -1;
+	}
+	if(new_pos > MAX_FILE_SIZE) {
+		errno = EFBIG;
+		return -1;
+	}
+	updateFileHandlePositionFromAbsolutePosition(handle, new_pos);
+	return 0;
+}
+
+int seekFAT(Handle file, FAT_int32_t offset, SeekWhence whence) {
+	return seekFAT64(file, offset, whence);
+}
+
+FAT_uint64_t tellFAT64(Handle file) {
+	FileHandle* handle = (FileHandle*)file;
+	return getAbsolutePosFromHandle(handle);
+}
+
+FAT_uint32_t tellFAT(Handle file) {
+	FAT_uint64_t absolute_pos = tellFAT64(file);
+	if(absolute_pos > (FAT_uint32_t)(~0)) {
+		errno = EOVERFLOW;
+		return (FAT_uint32_t)(~0);
+	}
+	return (FAT_uint32_t)absolute_pos;
+}
+
+static int truncateInlineFAT(FATBackingDisk* backing_disk, DirectoryEntry* entry, FAT_uint64_t new_size) {
+	if(new_size < entry->size)
+		memset(getInlineData(entry) + new_size, 0, (size_t)(entry->size - new_size));
+	setFileSize(backing_disk, entry, new_size);
+	return 0;
+}
+
+/*
+* The bytes past the end of the file in its last block are always kept zeroed,
+* so growing a file only has to update its size, the new part reads as a hole.
+*/
+static int truncateFAT64Unlocked(Handle file, FAT_uint64_t new_size) {
+	FAT_uint32_t last_block_index;
+	FAT_uint32_t current_fat_entry;
+	FAT_uint32_t current_block_index;
+	FAT_uint32_t tail;
+	BlockRelease release = { 0, 0 };
+	FileHandle* handle = (FileHandle*)file;
+	FATBackingDisk* backing_disk = getBackingDiskFromHandle(handle);
+	DirectoryEntry* entry = getDirectoryEntryFromHandle(handle);
+	if(backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	if(new_size > MAX_FILE_SIZE) {
+		errno = EFBIG;
+		return -1;
+	}
+	if(new_size > entry->size && checkDirQuotas(backing_disk, entry->parent_directory, new_size - entry->size, 0) == -1)
+		return -1;
+	if(entry->flags & FAT_FLAG_INLINE) {
+		if(new_size <= INLINE_DATA_SIZE)
+			return truncateInlineFAT(backing_disk, entry, new_size);
+		if(spillInlineFile(backing_disk, entry) != 0) {
+			errno = ENOSPC;
+			return -1;
+		}
+	}
+	if(new_size == entry->size)
+		return 0;
+	if((entry->flags & FAT_FLAG_COMPRESSED) && inflateFileEntry(backing_disk, entry) != 0)
+		return -1;
+	if(new_size > entry->size) {
+		setFileSize(backing_disk, entry, new_size);
+		return 0;
+	}
+	/*
+	* The first block is kept even for an empty file.
+	*/
+	last_block_index = new_size == 0 ? 0 : (FAT_uint32_t)((new_size - 1) / BLOCK_BUFFER_SIZE);
+	if(backing_disk->counters->shared_refs > 0 && unshareFileBlocks(backing_disk, entry, last_block_index) == -1) {
+		errno = ENOSPC;
+		return -1;
+	}
+	current_fat_entry = findFileBlock(backing_disk, entry, last_block_index, &current_block_index);
+	tail = getNextFatEntry(current_fat_entry);
+	setNextFatEntry(current_fat_entry, LAST_FAT_ENTRY);
+	getHoleBlocks(current_fat_entry) = 0;
+	/*
+	* The handles caching a block of the tail must not reach it anymore, even
+	* if it's kept by a clone instead of being released
+	*/
+	++(backing_disk->chain_generation);
+	freeFatChain(backing_disk, &release, tail);
+	flushBlockRelease(backing_disk, &release);
+	if(current_block_index == last_block_index && (new_size % BLOCK_BUFFER_SIZE != 0 || new_size == 0)) {
+		memset(getBlockFromIndex(current_fat_entry)->buffer + new_size % BLOCK_BUFFER_SIZE, 0,
+			   (size_t)(BLOCK_BUFFER_SIZE - new_size % BLOCK_BUFFER_SIZE));
+		updateBlockChecksum(backing_disk, current_fat_entry);
+	}
+	setFileSize(backing_disk, entry, new_size);
+	return 0;
+}
+
+int truncateFAT(Handle file, FAT_uint32_t new_size) {
+	return truncateFAT64(file, new_size);
+}
+
+static int createDirFATUnlocked(FAT fat, const char* dirname) {
+	int free_entry;
+	int used_entry;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	used_entry = findDirEntry(backing_disk, dirname, &free_entry, FAT_DIRECTORY);
+	if(used_entry == -1 && backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	if(free_entry == -1 && used_entry == -1) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if(used_entry != -1)
+		return 0;
+	if(checkDirQuotas(backing_disk, backing_disk->current_working_directory, 0, 1) == -1)
+		return -1;
 	return initializeDirEntry(backing_disk, free_entry, dirname, FAT_DIRECTORY);
 }
 
-int eraseDirFAT(FAT fat, const char* dirname) {
+static int eraseDirFATUnlocked(FAT fat, const char* dirname) {
+	DirectoryEntry* entry;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	int entry_id;
+	if(backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	entry_id = findDirEntry(backing_disk, dirname, NULL, FAT_DIRECTORY);
+	if(entry_id == -1)
+		return -1;
+	entry = getEntryFromIndex(entry_id);
+	if(entry->num_children > 0)
+		return -1;
+	removeChildFromFolder(backing_disk, entry->parent_directory, (FAT_uint16_t)entry_id);
+	memset(entry, 0, sizeof(DirectoryEntry));
+	invalidateNameIndex(backing_disk);
+	return 0;
+}
+
+static void eraseSubtree(FATBackingDisk* backing_disk, BlockRelease* release, FAT_uint16_t entry_id) {
+	int i;
+	DirectoryEntry* entry = getEntryFromIndex(entry_id);
+	if(entry->file_type == FAT_DIRECTORY) {
+		for(i = 0; i < MAX_DIR_CHILDREN && entry->children[i] != FREE_CHILD_ENTRY; ++i) {
+			if(entry->children[i] != DELETED_CHILD_ENTRY)
+				eraseSubtree(backing_disk, release, entry->children[i]);
+		}
+	} else {
+		freeFatChain(backing_disk, release, getFirstFatEntryFromDirectoryEntry(entry));
+	}
+	memset(entry, 0, sizeof(DirectoryEntry));
+	invalidateNameIndex(backing_disk);
+}
+
+static int eraseTreeFATUnlocked(FAT fat, const char* dirname) {
+	BlockRelease release = { 0, 0 };
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	int entry_id;
+	if(backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	entry_id = findDirEntry(backing_disk, dirname, NULL, FAT_DIRECTORY);
+	if(entry_id == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+	removeChildFromFolder(backing_disk, backing_disk->current_working_directory, (FAT_uint16_t)entry_id);
+	eraseSubtree(backing_disk, &release, (FAT_uint16_t)entry_id);
+	flushBlockRelease(backing_disk, &release);
+	return 0;
+}
+
+/*
+* Looks up a file or directory directly in the children of the passed directory.
+*/
+static int findChildEntry(FATBackingDisk* backing_disk, FAT_uint16_t parent_id, const char* filename) {
+	int i;
+	FAT_uint16_t child;
+	DirectoryEntry* parent = getEntryFromIndex(parent_id);
+	for(i = 0; i < MAX_DIR_CHILDREN; ++i) {
+		child = parent->children[i];
+		if(child == FREE_CHILD_ENTRY)
+			break;
+		if(child != DELETED_CHILD_ENTRY &&
+		   strncmp(filename, getEntryFromIndex(child)->filename, DIRECTORY_ENTRY_MAX_NAME) == 0)
+			return child;
+	}
+	return -1;
+}
+
+/*
+* Free directory entries, collected once for a whole batch instead of scanning
+* the directory table for every file that gets created.
+*/
+typedef struct BatchIndex {
+	FAT_uint16_t free_entries[TOTAL_DIR_ENTRIES];
+	int total_free_entries;
+} BatchIndex;
+
+/*
+* Returns 0 on success, or the errno value of the failure.
+*/
+static int runBatchOperation(FATBackingDisk* backing_disk, BatchIndex* index, BlockRelease* release, const BatchOperation* operation) {
+	int entry_id;
+	FAT_int64_t written;
+	FileHandle handle;
+	if(operation->filename[0] == '\0')
+		return EINVAL;
+	/*
+	* Only the children of the working directory are looked at, not the whole directory table
+	*/
+	entry_id = findChildEntry(backing_disk, backing_disk->current_working_directory, operation->filename);
+	if(entry_id != -1 && getEntryFromIndex(entry_id)->file_type != FAT_FILE)
+		return EISDIR;
+	switch(operation->type) {
+		case FAT_BATCH_ERASE:
+			if(entry_id == -1)
+				return ENOENT;
+			unlinkFileEntry(backing_disk, release, entry_id);
+			index->free_entries[index->total_free_entries++] = (FAT_uint16_t)entry_id;
+			return 0;
+		case FAT_BATCH_CREATE:
+			if(entry_id != -1) {
+				unlinkFileEntry(backing_disk, release, entry_id);
+				flushBlockRelease(backing_disk, release);
+			} else {
+				if(index->total_free_entries == 0 ||
+				   getEntryFromIndex(backing_disk->current_working_directory)->num_children >= MAX_DIR_CHILDREN)
+					return ENOSPC;
+				if(checkDirQuotas(backing_disk, backing_disk->current_working_directory, 0, 1) == -1)
+					return EDQUOT;
+				entry_id = index->free_entries[--(index->total_free_entries)];
+			}
+			initializeDirEntry(backing_disk, entry_id, operation->filename, FAT_FILE);
+			break;
+		case FAT_BATCH_WRITE:
+			if(entry_id == -1)
+				return ENOENT;
+			break;
+		default:
+			return EINVAL;
+	}
+	if(operation->size == 0)
+		return 0;
+	setupHandle(&handle, backing_disk, entry_id);
+	if(seekFAT64Unlocked(&handle, (FAT_int64_t)operation->offset, FAT_SEEK_SET) != 0)
+		return EFBIG;
+	errno = 0;
+	written = writeFAT64Unlocked(&handle, operation->data, operation->size);
+	free(handle.cluster_cache);
+	if(written != (FAT_int64_t)operation->size)
+		return errno != 0 ? errno : ENOSPC;
+	return 0;
+}
+
+static int submitBatchFATUnlocked(FAT fat, BatchOperation* operations, int count) {
+	int i;
+	int failed = 0;
+	BatchIndex index;
+	BlockRelease release = { 0, 0 };
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	if(backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	index.total_free_entries = 0;
+	for(i = TOTAL_DIR_ENTRIES - 1; i > ROOT_WORKING_DIRECTORY; --i) {
+		if(getEntryFromIndex(i)->filename[0] == 0)
+			index.free_entries[index.total_free_entries++] = (FAT_uint16_t)i;
+	}
+	for(i = 0; i < count; ++i) {
+		/*
+		* The blocks freed by the erases must be given back to the host
+		* before they can be allocated again
+		*/
+		if(operations[i].type != FAT_BATCH_ERASE)
+			flushBlockRelease(backing_disk, &release);
+		operations[i].result = runBatchOperation(backing_disk, &index, &release, &operations[i]);
+		if(operations[i].result != 0)
+			++failed;
+	}
+	flushBlockRelease(backing_disk, &release);
+	return failed;
+}
+
+/*
+* Resolves a path made of directory names separated by slashes, relative to the
+* current working directory, or to the root directory if it starts with a slash.
+* ".." refers to the parent directory.
+*/
+static int resolveDirPath(FATBackingDisk* backing_disk, const char* path) {
+	char component[DIRECTORY_ENTRY_MAX_NAME];
+	size_t length;
+	int child;
+	FAT_uint16_t current = backing_disk->current_working_directory;
+	if(*path == '/' || *path == '\\')
+		current = ROOT_WORKING_DIRECTORY;
+	while(*path != '\0') {
+		length = strcspn(path, "/\\");
+		if(length >= sizeof(component))
+			return -1;
+		memcpy(component, path, length);
+		component[length] = '\0';
+		path += length;
+		if(*path != '\0')
+			++path;
+		if(length == 0 || strcmp(component, ".") == 0)
+			continue;
+		if(strcmp(component, "..") == 0) {
+			if(current == ROOT_WORKING_DIRECTORY)
+				return -1;
+			current = getEntryFromIndex(current)->parent_directory;
+			continue;
+		}
+		child = findChildEntry(backing_disk, current, component);
+		if(child == -1 || getEntryFromIndex(child)->file_type != FAT_DIRECTORY)
+			return -1;
+		current = (FAT_uint16_t)child;
+	}
+	return current;
+}
+
+static int renameFATUnlocked(FAT fat, const char* filename, const char* new_filename) {
+	int entry_id;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	if(backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	/*
+	* Paths split on both kinds of slashes, and "." and ".." are resolved before
+	* the names, so an element named like that couldn't be reached anymore
+	*/
+	if(new_filename[0] == '\0' || strpbrk(new_filename, "/\\") != NULL ||
+	   strcmp(new_filename, ".") == 0 || strcmp(new_filename, "..") == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	entry_id = findChildEntry(backing_disk, backing_disk->current_working_directory, filename);
+	if(entry_id == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+	if(findChildEntry(backing_disk, backing_disk->current_working_directory, new_filename) != -1) {
+		errno = EEXIST;
+		return -1;
+	}
+	strncpy(getEntryFromIndex(entry_id)->filename, new_filename, DIRECTORY_ENTRY_MAX_NAME);
+	invalidateNameIndex(backing_disk);
+	return 0;
+}
+
+static int moveFATUnlocked(FAT fat, const char* filename, const char* dest_dirname) {
+	int entry_id;
+	int dest_id;
+	FAT_uint16_t ancestor;
+	FAT_uint16_t old_parent_id;
+	DirectoryEntry* entry;
+	DirectoryEntry* dest;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	if(backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	entry_id = findChildEntry(backing_disk, backing_disk->current_working_directory, filename);
+	dest_id = resolveDirPath(backing_disk, dest_dirname);
+	if(entry_id == -1 || dest_id == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+	entry = getEntryFromIndex(entry_id);
+	dest = getEntryFromIndex(dest_id);
+	if(entry->parent_directory == dest_id)
+		return 0;
+	/*
+	* A directory can't be moved inside itself
+	*/
+	for(ancestor = (FAT_uint16_t)dest_id; ancestor != ROOT_WORKING_DIRECTORY; ancestor = getEntryFromIndex(ancestor)->parent_directory) {
+		if(ancestor == entry_id) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	if(findChildEntry(backing_disk, (FAT_uint16_t)dest_id, entry->filename) != -1) {
+		errno = EEXIST;
+		return -1;
+	}
+	if(dest->num_children >= MAX_DIR_CHILDREN) {
+		errno = ENOSPC;
+		return -1;
+	}
+	/*
+	* Checked once the entry is out of its old directory, so that the directories
+	* containing both aren't counted twice
+	*/
+	old_parent_id = entry->parent_directory;
+	removeChildFromFolder(backing_disk, old_parent_id, (FAT_uint16_t)entry_id);
+	if(checkDirQuotas(backing_disk, (FAT_uint16_t)dest_id, entry->size, getEntryCount(entry)) == -1) {
+		addChildToFolder(backing_disk, old_parent_id, (FAT_uint16_t)entry_id);
+		return -1;
+	}
+	addChildToFolder(backing_disk, (FAT_uint16_t)dest_id, (FAT_uint16_t)entry_id);
+	entry->parent_directory = (FAT_uint16_t)dest_id;
+	return 0;
+}
+
+static int statDirFATUnlocked(FAT fat, const char* dirname, DirectoryStats* stats) {
+	DirectoryEntry* directory;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	int directory_id = resolveDirPath(backing_disk, dirname);
+	if(directory_id == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+	directory = getEntryFromIndex(directory_id);
+	stats->size = directory->size;
+	stats->total_entries = directory->total_entries;
+	stats->max_size = directory->max_size;
+	stats->max_entries = directory->max_entries;
+	return 0;
+}
+
+static int setDirQuotaFATUnlocked(FAT fat, const char* dirname, FAT_uint64_t max_size, FAT_uint32_t max_entries) {
+	DirectoryEntry* directory;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	int directory_id;
+	if(backing_disk->read_only) {
+		errno = EROFS;
+		return -1;
+	}
+	directory_id = resolveDirPath(backing_disk, dirname);
+	if(directory_id == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+	directory = getEntryFromIndex(directory_id);
+	directory->max_size = max_size;
+	directory->max_entries = max_entries;
+	return 0;
+}
+
+static int changeDirFATUnlocked(FAT fat, const char* new_dirname) {
+	int entry_id;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	/* Go up 1 folder */
+	if(new_dirname[0] == '.' && new_dirname[1] == '.' && new_dirname[2] == '\0') {
+		if(backing_disk->current_working_directory == ROOT_WORKING_DIRECTORY)
+			return -1;
+		backing_disk->current_working_directory = getEntryFromIndex(backing_disk->current_working_directory)->parent_directory;
+		return 0;
+	}
+	/* Set working directory to root */
+	if((new_dirname[0] == '/' || new_dirname[0] == '\\') && new_dirname[1] == '\0') {
+		backing_disk->current_working_directory = ROOT_WORKING_DIRECTORY;
+		return 0;
+	}
+	entry_id = findDirEntry(backing_disk, new_dirname, NULL, FAT_DIRECTORY);
+	if(entry_id == -1)
+		return -1;
+	backing_disk->current_working_directory = (FAT_uint16_t)entry_id;
+	return 0;
+}
+
+static DirectoryElement* listDirFATUnlocked(FAT fat) {
+	size_t i;
+	size_t total;
+	DirectoryEntry* current_directory;
+	DirectoryEntry* current_child_entry;
+	DirectoryElement* list;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	current_directory = getEntryFromIndex(backing_disk->current_working_directory);
+	/*
+	* The list is filled in place with no intermediate buffer, never past num_children
+	* entries, so that a corrupted count can't make it overflow
+	*/
+	list = (DirectoryElement*)malloc((current_directory->num_children + 1) * sizeof(DirectoryElement));
+	if(list == NULL)
+		return NULL;
+	for(i = 0, total = 0; i < MAX_DIR_CHILDREN && total < current_directory->num_children &&
+	    current_directory->children[i] != FREE_CHILD_ENTRY; ++i) {
+		if(current_directory->children[i] != DELETED_CHILD_ENTRY) {
+			current_child_entry = getEntryFromIndex(current_directory->children[i]);
+			list[total].filename = current_child_entry->filename;
+			list[total].file_type = (DirectoryEntryType)current_child_entry->file_type;
+			++total;
+		}
+	}
+	list[total].filename = NULL;
+	return list;
+}
+
+void freeDirList(DirectoryElement* list) {
+	if(list)
+		free(list);
+}
+
+static int compareEntryNames(const void* a, const void* b) {
+	return strncmp((*(DirectoryEntry* const*)a)->filename, (*(DirectoryEntry* const*)b)->filename, DIRECTORY_ENTRY_MAX_NAME);
+}
+
+static void buildNameIndex(FATBackingDisk* backing_disk) {
+	int i;
+	DirectoryEntry* entry;
+	backing_disk->total_indexed_names = 0;
+	for(i = ROOT_WORKING_DIRECTORY + 1; i < TOTAL_DIR_ENTRIES; ++i) {
+		entry = getEntryFromIndex(i);
+		if(entry->filename[0] != 0)
+			backing_disk->name_index[backing_disk->total_indexed_names++] = entry;
+	}
+	qsort(backing_disk->name_index, (size_t)backing_disk->total_indexed_names, sizeof(DirectoryEntry*), compareEntryNames);
+	backing_disk->name_index_valid = 1;
+}
+
+/*
+* Returns the position in the name index of the first name not smaller than
+* the first *length* characters of *name*.
+*/
+static int findFirstIndexedName(FATBackingDisk* backing_disk, const char* name, size_t length) {
+	int low = 0;
+	int high = backing_disk->total_indexed_names;
+	int middle;
+	while(low < high) {
+		middle = low + (high - low) / 2;
+		if(strncmp(backing_disk->name_index[middle]->filename, name, length) < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+/*
+* Names using all the DIRECTORY_ENTRY_MAX_NAME characters have no terminator.
+*/
+static size_t getEntryNameLength(const DirectoryEntry* entry) {
+	const char* end = (const char*)memchr(entry->filename, '\0', DIRECTORY_ENTRY_MAX_NAME);
+	return end == NULL ? DIRECTORY_ENTRY_MAX_NAME : (size_t)(end - entry->filename);
+}
+
+/*
+* Writes the full path of the entry in *path*, growing it as needed.
+* Returns -1 on error.
+*/
+static int buildEntryPath(FATBackingDisk* backing_disk, DirectoryEntry* entry, char** path, size_t* path_size) {
+	size_t length = 0;
+	size_t name_length;
+	char* new_path;
+	DirectoryEntry* current;
+	for(current = entry; current != getEntryFromIndex(ROOT_WORKING_DIRECTORY); current = getEntryFromIndex(current->parent_directory))
+		length += getEntryNameLength(current) + 1;
+	if(length + 1 > *path_size) {
+		new_path = (char*)realloc(*path, length + 1);
+		if(new_path == NULL)
+			return -1;
+		*path = new_path;
+		*path_size = length + 1;
+	}
+	(*path)[length] = '\0';
+	for(current = entry; current != getEntryFromIndex(ROOT_WORKING_DIRECTORY); current = getEntryFromIndex(current->parent_directory)) {
+		name_length = getEntryNameLength(current);
+		length -= name_length;
+		memcpy(*path + length, current->filename, name_length);
+		(*path)[--length] = '/';
+	}
+	return 0;
+}
+
+static int findFATUnlocked(FAT fat, const char* pattern, FindMode mode, FindCallback callback, void* user_data) {
+	int i;
+	int found = 0;
+	size_t prefix_length;
+	size_t path_size = 0;
+	char* path = NULL;
+	char name[DIRECTORY_ENTRY_MAX_NAME + 1];
 	DirectoryEntry* entry;
 	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
-	int entry_id = findDirEntry(backing_disk, dirname, NULL, FAT_DIRECTORY);
-	if(entry_id == -1)
+	switch(mode) {
+		case FAT_FIND_EXACT:
+			prefix_length = DIRECTORY_ENTRY_MAX_NAME;
+			break;
+		case FAT_FIND_PREFIX:
+			prefix_length = strlen(pattern);
+			break;
+		case FAT_FIND_GLOB:
+			/*
+			* Only the names starting with the part of the pattern before the first
+			* wildcard can match, the others are never looked at
+			*/
+			prefix_length = strcspn(pattern, "*?[\\");
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+	if(!backing_disk->name_index_valid)
+		buildNameIndex(backing_disk);
+	name[DIRECTORY_ENTRY_MAX_NAME] = '\0';
+	for(i = findFirstIndexedName(backing_disk, pattern, prefix_length); i < backing_disk->total_indexed_names; ++i) {
+		entry = backing_disk->name_index[i];
+		if(strncmp(entry->filename, pattern, prefix_length) != 0)
+			break;
+		if(mode == FAT_FIND_GLOB) {
+			memcpy(name, entry->filename, DIRECTORY_ENTRY_MAX_NAME);
+			if(fnmatch(pattern, name, 0) != 0)
+				continue;
+		}
+		if(buildEntryPath(backing_disk, entry, &path, &path_size) == -1) {
+			free(path);
+			errno = ENOMEM;
+			return -1;
+		}
+		++found;
+		if(callback(path, (DirectoryEntryType)entry->file_type, user_data) != 0)
+			break;
+	}
+	free(path);
+	return found;
+}
+
+
+void setChecksumModeFAT(FAT fat, ChecksumMode mode) {
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	settleStaleChecksums(backing_disk);
+	backing_disk->checksum_mode = mode;
+}
+
+typedef struct ScrubWorker {
+	FATBackingDisk* backing_disk;
+	FAT_uint32_t first_block;
+	FAT_uint32_t end_block;
+	ScrubReport report;
+} ScrubWorker;
+
+static void* scrubBlocks(void* arg) {
+	FAT_uint32_t i;
+	ScrubWorker* worker = (ScrubWorker*)arg;
+	FATBackingDisk* backing_disk = worker->backing_disk;
+	for(i = worker->first_block; i < worker->end_block; ++i) {
+		if(getNextFatEntry(i) == UNUSED_FAT_ENTRY)
+			continue;
+		if(getBlockChecksum(i) == 0) {
+			++(worker->report.unknown_blocks);
+			continue;
+		}
+		++(worker->report.checked_blocks);
+		if(getBlockChecksum(i) != normalizeChecksum(crc32c(0, getBlockFromIndex(i), sizeof(FileBlock))))
+			++(worker->report.corrupted_blocks);
+	}
+	return NULL;
+}
+
+static int scrubFATUnlocked(FAT fat, int threads, ScrubReport* report) {
+	int i;
+	ScrubWorker workers[MAX_SCRUB_THREADS];
+	pthread_t thread_ids[MAX_SCRUB_THREADS];
+	int started[MAX_SCRUB_THREADS];
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	if(threads < 1)
+		threads = 1;
+	if(threads > MAX_SCRUB_THREADS)
+		threads = MAX_SCRUB_THREADS;
+	settleStaleChecksums(backing_disk);
+	for(i = 0; i < threads; ++i) {
+		workers[i].backing_disk = backing_disk;
+		workers[i].first_block = (FAT_uint32_t)(TOTAL_BLOCKS / threads * i);
+		workers[i].end_block = i == threads - 1 ? TOTAL_BLOCKS : (FAT_uint32_t)(TOTAL_BLOCKS / threads * (i + 1));
+		memset(&workers[i].report, 0, sizeof(ScrubReport));
+	}
+	/*
+	* The calling thread scrubs the first range, and any range whose thread couldn't be started
+	*/
+	for(i = 1; i < threads; ++i)
+		started[i] = pthread_create(&thread_ids[i], NULL, scrubBlocks, &workers[i]) == 0;
+	scrubBlocks(&workers[0]);
+	memset(report, 0, sizeof(ScrubReport));
+	for(i = 0; i < threads; ++i) {
+		if(i > 0) {
+			if(started[i])
+				pthread_join(thread_ids[i], NULL);
+			else
+				scrubBlocks(&workers[i]);
+		}
+		report->checked_blocks += workers[i].report.checked_blocks;
+		report->unknown_blocks += workers[i].report.unknown_blocks;
+		report->corrupted_blocks += workers[i].report.corrupted_blocks;
+	}
+	report->metadata_corrupted = backing_disk->metadata_corrupted;
+	return 0;
+}
+
+/*
+* Flushes the tables and the passed blocks of the disk to the file, grouping
+* the consecutive blocks.
+* Returns -1 on error.
+*/
+static int writeBackDisk(Disk* disk, const FAT_uint8_t* dirty_blocks) {
+	FAT_uint32_t first;
+	FAT_uint32_t last;
+	char* start;
+	char* end;
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	if(msync(disk, offsetof(Disk, blocks), MS_SYNC) != 0)
 		return -1;
-	entry = getEntryFromIndex(entry_id);
-	if(entry->num_children > 0)
+	for(first = 0; first < TOTAL_BLOCKS; first = last) {
+		if(!(dirty_blocks[first / 8] & (1 << (first % 8)))) {
+			last = first + 1;
+			continue;
+		}
+		for(last = first + 1; last < TOTAL_BLOCKS && (dirty_blocks[last / 8] & (1 << (last % 8))); ++last)
+			;
+		/*
+		* msync needs an address aligned to the page, the mapping itself is
+		*/
+		start = (char*)&disk->blocks[first];
+		end = (char*)&disk->blocks[last];
+		start -= (size_t)(start - (char*)disk) % page_size;
+		if(msync(start, (size_t)(end - start), MS_SYNC) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void setFlushDeadline(struct timespec* deadline, FAT_uint64_t time) {
+	deadline->tv_sec = (time_t)(time / 1000000000u);
+	deadline->tv_nsec = (long)(time % 1000000000u);
+}
+
+/*
+* Waits for changes, and writes them back once they're too many or too old.
+*/
+static void* runFlusher(void* arg) {
+	int err;
+	Flusher* flusher = (Flusher*)arg;
+	FAT_uint8_t dirty_blocks[(TOTAL_BLOCKS + 7) / 8];
+	FAT_uint32_t total_dirty_blocks;
+	FAT_uint64_t deadline;
+	FAT_uint64_t start;
+	FAT_uint64_t elapsed;
+	struct timespec timeout;
+	pthread_mutex_lock(&flusher->mutex);
+	for(;;) {
+		if(!flusher->dirty) {
+			if(flusher->stop)
+				break;
+			pthread_cond_wait(&flusher->wake, &flusher->mutex);
+			continue;
+		}
+		deadline = flusher->dirty_since + (FAT_uint64_t)flusher->policy.max_dirty_age_ms * 1000000u;
+		/*
+		* Once stopping, what's left is written back right away
+		*/
+		if(!flusher->stop) {
+			if(flusher->total_dirty_blocks >= flusher->policy.max_dirty_blocks) {
+				++(flusher->stats.volume_flushes);
+			} else if(getTraceTime() >= deadline) {
+				++(flusher->stats.age_flushes);
+			} else {
+				setFlushDeadline(&timeout, deadline);
+				pthread_cond_timedwait(&flusher->wake, &flusher->mutex, &timeout);
+				continue;
+			}
+		}
+		memcpy(dirty_blocks, flusher->dirty_blocks, sizeof(dirty_blocks));
+		memset(flusher->dirty_blocks, 0, sizeof(flusher->dirty_blocks));
+		total_dirty_blocks = flusher->total_dirty_blocks;
+		flusher->total_dirty_blocks = 0;
+		flusher->dirty = 0;
+		/*
+		* The FAT keeps handing over changes while they're written back
+		*/
+		pthread_mutex_unlock(&flusher->mutex);
+		start = getTraceTime();
+		err = writeBackDisk(flusher->disk, dirty_blocks) == 0 ? 0 : errno;
+		elapsed = getTraceTime() - start;
+		pthread_mutex_lock(&flusher->mutex);
+		if(err != 0)
+			flusher->error = err;
+		++(flusher->stats.flushes);
+		flusher->stats.flushed_blocks += total_dirty_blocks;
+		flusher->stats.flush_time += elapsed;
+		if(elapsed > flusher->stats.max_flush_time)
+			flusher->stats.max_flush_time = elapsed;
+	}
+	pthread_mutex_unlock(&flusher->mutex);
+	return NULL;
+}
+
+/*
+* Passes the blocks changed by the last call to the flusher thread.
+*/
+static void handOverDirtyBlocks(FATBackingDisk* backing_disk) {
+	size_t i;
+	FAT_uint8_t added;
+	Flusher* flusher = backing_disk->flusher;
+	pthread_mutex_lock(&flusher->mutex);
+	for(i = 0; i < sizeof(backing_disk->dirty_blocks); ++i) {
+		for(added = backing_disk->dirty_blocks[i] & (FAT_uint8_t)~flusher->dirty_blocks[i]; added != 0; added &= (FAT_uint8_t)(added - 1))
+			++(flusher->total_dirty_blocks);
+		flusher->dirty_blocks[i] |= backing_disk->dirty_blocks[i];
+	}
+	memset(backing_disk->dirty_blocks, 0, sizeof(backing_disk->dirty_blocks));
+	/*
+	* The thread only needs to wake up to start counting the age of the changes,
+	* or once there are enough of them
+	*/
+	if(!flusher->dirty) {
+		flusher->dirty = 1;
+		flusher->dirty_since = getTraceTime();
+		pthread_cond_signal(&flusher->wake);
+	} else if(flusher->total_dirty_blocks >= flusher->policy.max_dirty_blocks) {
+		pthread_cond_signal(&flusher->wake);
+	}
+	pthread_mutex_unlock(&flusher->mutex);
+}
+
+int startFlusherFAT(FAT fat, const FlushPolicy* policy) {
+	int err;
+	pthread_condattr_t attributes;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	Flusher* flusher;
+	if(backing_disk->flusher != NULL) {
+		errno = EBUSY;
 		return -1;
-	if(entry->parent_directory != ROOT_WORKING_DIRECTORY)
-		removeChildFromFolder(getEntryFromIndex(entry->parent_directory), (FAT_uint16_t)entry_id);
-	memset(entry, 0, sizeof(DirectoryEntry));
+	}
+	if(policy->max_dirty_blocks == 0 || policy->max_dirty_age_ms == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	flusher = (Flusher*)malloc(sizeof(Flusher));
+	if(flusher == NULL)
+		return -1;
+	flusher->policy = *policy;
+	flusher->disk = backing_disk->mmapped_disk;
+	memset(flusher->dirty_blocks, 0, sizeof(flusher->dirty_blocks));
+	flusher->total_dirty_blocks = 0;
+	flusher->dirty = 0;
+	flusher->stop = 0;
+	flusher->error = 0;
+	flusher->stats = backing_disk->flush_stats;
+	pthread_mutex_init(&flusher->mutex, NULL);
+	/*
+	* The deadlines are computed from getTraceTime, that uses the monotonic clock
+	*/
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&flusher->wake, &attributes);
+	pthread_condattr_destroy(&attributes);
+	err = pthread_create(&flusher->thread, NULL, runFlusher, flusher);
+	if(err != 0) {
+		pthread_cond_destroy(&flusher->wake);
+		pthread_mutex_destroy(&flusher->mutex);
+		free(flusher);
+		errno = err;
+		return -1;
+	}
+	memset(backing_disk->dirty_blocks, 0, sizeof(backing_disk->dirty_blocks));
+	backing_disk->flusher = flusher;
 	return 0;
 }
 
-int changeDirFAT(FAT fat, const char* new_dirname) {
-	int entry_id;
+int stopFlusherFAT(FAT fat) {
+	int err;
 	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
-	/* Go up 1 folder */
-	if(new_dirname[0] == '.' && new_dirname[1] == '.' && new_dirname[2] == '\0') {
-		if(backing_disk->current_working_directory == ROOT_WORKING_DIRECTORY)
-			return -1;
-		backing_disk->current_working_directory = getEntryFromIndex(backing_disk->current_working_directory)->parent_directory;
+	Flusher* flusher = backing_disk->flusher;
+	if(flusher == NULL)
 		return 0;
+	pthread_mutex_lock(&flusher->mutex);
+	flusher->stop = 1;
+	pthread_cond_signal(&flusher->wake);
+	pthread_mutex_unlock(&flusher->mutex);
+	pthread_join(flusher->thread, NULL);
+	err = flusher->error;
+	backing_disk->flush_stats = flusher->stats;
+	pthread_cond_destroy(&flusher->wake);
+	pthread_mutex_destroy(&flusher->mutex);
+	free(flusher);
+	backing_disk->flusher = NULL;
+	if(err != 0) {
+		errno = err;
+		return -1;
 	}
-	/* Set working directory to root */
-	if((new_dirname[0] == '/' || new_dirname[0] == '\\') && new_dirname[1] == '\0') {
+	return 0;
+}
+
+void getFlushStatsFAT(FAT fat, FlushStats* stats) {
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	Flusher* flusher = backing_disk->flusher;
+	if(flusher == NULL) {
+		*stats = backing_disk->flush_stats;
+		return;
+	}
+	pthread_mutex_lock(&flusher->mutex);
+	*stats = flusher->stats;
+	stats->dirty_blocks = flusher->total_dirty_blocks;
+	pthread_mutex_unlock(&flusher->mutex);
+}
+
+/*
+* Drops what this process cached from a shared disk changed by another process.
+*/
+static void reloadSharedState(FATBackingDisk* backing_disk) {
+	DirectoryEntry* working_directory;
+	backing_disk->seen_generation = backing_disk->shared->generation;
+	++(backing_disk->chain_generation);
+	++(backing_disk->compression_generation);
+	invalidateNameIndex(backing_disk);
+	/*
+	* The blocks could have been rewritten by another process
+	*/
+	memset(backing_disk->verified_blocks, 0, sizeof(backing_disk->verified_blocks));
+	working_directory = getEntryFromIndex(backing_disk->current_working_directory);
+	if(working_directory->filename[0] == 0 || working_directory->file_type != FAT_DIRECTORY)
 		backing_disk->current_working_directory = ROOT_WORKING_DIRECTORY;
+}
+
+/*
+* Does nothing if the disk isn't shared.
+* Returns -1 on error.
+*/
+static int lockDisk(FATBackingDisk* backing_disk) {
+	int err;
+	if(backing_disk->shared == NULL)
 		return 0;
+	err = pthread_mutex_lock(&backing_disk->shared->mutex);
+	if(err == EOWNERDEAD) {
+		/*
+		* A process died in the middle of an operation, what it was changing
+		* could have been left half done
+		*/
+		pthread_mutex_consistent(&backing_disk->shared->mutex);
+		backing_disk->metadata_corrupted = 1;
+		++(backing_disk->shared->generation);
+	} else if(err != 0) {
+		errno = err;
+		return -1;
 	}
-	entry_id = findDirEntry(backing_disk, new_dirname, NULL, FAT_DIRECTORY);
-	if(entry_id == -1)
+	if(backing_disk->lock_depth++ == 0 && backing_disk->shared->generation != backing_disk->seen_generation)
+		reloadSharedState(backing_disk);
+	return 0;
+}
+
+static void unlockDisk(FATBackingDisk* backing_disk, int changed) {
+	if(changed && backing_disk->flusher != NULL)
+		handOverDirtyBlocks(backing_disk);
+	if(backing_disk->shared == NULL)
+		return;
+	backing_disk->changed_while_locked |= changed;
+	if(--(backing_disk->lock_depth) == 0 && backing_disk->changed_while_locked) {
+		backing_disk->seen_generation = ++(backing_disk->shared->generation);
+		backing_disk->changed_while_locked = 0;
+	}
+	pthread_mutex_unlock(&backing_disk->shared->mutex);
+}
+
+#define getHandleDisk(handle) ((FATBackingDisk*)((FileHandle*)(handle))->backing_disk)
+
+/*
+* Returns 0 if no trace is running, so that the time is only read when needed.
+*/
+#define beginTrace(backing_disk) ((backing_disk)->trace != NULL ? getTraceTime() : 0)
+#define getHandleDescriptor(handle) (((FileHandle*)(handle))->descriptor)
+
+static void traceCall(FATBackingDisk* backing_disk, FAT_uint64_t start, TraceOperation operation, int handle,
+					  int mode, FAT_int64_t argument, FAT_int64_t result, const char* name, const char* name2) {
+	int prev_errno = errno;
+	TraceRecord record;
+	record.operation = operation;
+	record.handle = handle;
+	record.mode = mode;
+	record.argument = argument;
+	record.argument2 = 0;
+	record.result = result;
+	record.start = start;
+	record.duration = getTraceTime() - start;
+	record.name = name;
+	record.name2 = name2;
+	writeTraceRecord(backing_disk->trace, &record);
+	errno = prev_errno;
+}
+
+static void traceBatch(FATBackingDisk* backing_disk, FAT_uint64_t start, const BatchOperation* operations, int count, int result) {
+	int i;
+	int prev_errno = errno;
+	TraceRecord record;
+	traceCall(backing_disk, start, TRACE_BATCH, -1, 0, count, result, NULL, NULL);
+	for(i = 0; i < count; ++i) {
+		record.operation = TRACE_BATCH_OPERATION;
+		record.handle = -1;
+		record.mode = (FAT_int32_t)operations[i].type;
+		record.argument = (FAT_int64_t)operations[i].size;
+		record.argument2 = (FAT_int64_t)operations[i].offset;
+		record.result = operations[i].result;
+		record.start = start;
+		record.duration = 0;
+		record.name = operations[i].filename;
+		record.name2 = NULL;
+		writeTraceRecord(backing_disk->trace, &record);
+	}
+	errno = prev_errno;
+}
+
+static FAT_int64_t getVectorsLength(const IoVector* vectors, int count) {
+	int i;
+	FAT_int64_t length = 0;
+	for(i = 0; i < count; ++i)
+		length += (FAT_int64_t)vectors[i].length;
+	return length;
+}
+
+int startTraceFAT(FAT fat, const char* trace_name) {
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	FILE* trace;
+	if(backing_disk->trace != NULL) {
+		errno = EBUSY;
 		return -1;
-	backing_disk->current_working_directory = (FAT_uint16_t)entry_id;
+	}
+	trace = createTrace(trace_name);
+	if(trace == NULL)
+		return -1;
+	backing_disk->trace = trace;
 	return 0;
 }
 
-static DirectoryElement tmp_folders[MAX_DIR_CHILDREN + 1];
+int stopTraceFAT(FAT fat) {
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	FILE* trace = backing_disk->trace;
+	if(trace == NULL)
+		return 0;
+	backing_disk->trace = NULL;
+	return fclose(trace) == 0 ? 0 : -1;
+}
+
+/*
+* The public functions lock a shared disk for their whole duration, and record
+* the call if a trace is running.
+*/
+
+FAT snapshotFAT(FAT fat, const char* snapshot_name) {
+	FAT result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return NULL;
+	result = snapshotFATUnlocked(fat, snapshot_name);
+	unlockDisk(backing_disk, 0);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_SNAPSHOT, -1, 0, 0, result != NULL ? 0 : -1, snapshot_name, NULL);
+	return result;
+}
+
+int openFileFAT(FAT fat, const char* filename) {
+	int result;
+	int created;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = openFileFATUnlocked(fat, filename, &created);
+	/*
+	* Opening an existing file must not make the other processes sharing the disk drop their caches
+	*/
+	unlockDisk(backing_disk, created);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_OPEN, -1, 0, 0, result, filename, NULL);
+	return result;
+}
+
+int eraseFileFAT(FAT fat, const char* filename) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = eraseFileFATUnlocked(fat, filename);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_ERASE, -1, 0, 0, result, filename, NULL);
+	return result;
+}
+
+int eraseFileFATAt(Handle file) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = getHandleDisk(file);
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = eraseFileFATAtUnlocked(file);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_ERASE_AT, getHandleDescriptor(file), 0, 0, result, NULL, NULL);
+	return result;
+}
+
+int cloneFileFAT(FAT fat, const char* src_filename, const char* dst_filename) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = cloneFileFATUnlocked(fat, src_filename, dst_filename);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_CLONE, -1, 0, 0, result, src_filename, dst_filename);
+	return result;
+}
+
+int dedupFAT(FAT fat, DedupReport* report) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = dedupFATUnlocked(fat, report);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_DEDUP, -1, 0, 0, result, NULL, NULL);
+	return result;
+}
+
+int compressFileFAT(FAT fat, const char* filename) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = compressFileFATUnlocked(fat, filename);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_COMPRESS, -1, 0, 0, result, filename, NULL);
+	return result;
+}
+
+FAT_int64_t writeFAT64(Handle to, const void* in, size_t size) {
+	FAT_int64_t result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = getHandleDisk(to);
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = writeFAT64Unlocked(to, in, size);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_WRITE, getHandleDescriptor(to), 0, (FAT_int64_t)size, result, NULL, NULL);
+	return result;
+}
+
+FAT_int64_t readFAT64(Handle from, void* out, size_t size) {
+	FAT_int64_t result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = getHandleDisk(from);
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = readFAT64Unlocked(from, out, size);
+	unlockDisk(backing_disk, 0);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_READ, getHandleDescriptor(from), 0, (FAT_int64_t)size, result, NULL, NULL);
+	return result;
+}
+
+FAT_int64_t readvFAT(Handle from, const IoVector* vectors, int count) {
+	FAT_int64_t result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = getHandleDisk(from);
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = readvFATUnlocked(from, vectors, count);
+	unlockDisk(backing_disk, 0);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_READV, getHandleDescriptor(from), count, getVectorsLength(vectors, count), result, NULL, NULL);
+	return result;
+}
+
+FAT_int64_t writevFAT(Handle to, const IoVector* vectors, int count) {
+	FAT_int64_t result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = getHandleDisk(to);
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = writevFATUnlocked(to, vectors, count);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_WRITEV, getHandleDescriptor(to), count, getVectorsLength(vectors, count), result, NULL, NULL);
+	return result;
+}
+
+int seekFAT64(Handle file, FAT_int64_t offset, SeekWhence whence) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = getHandleDisk(file);
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = seekFAT64Unlocked(file, offset, whence);
+	unlockDisk(backing_disk, 0);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_SEEK, getHandleDescriptor(file), (int)whence, offset, result, NULL, NULL);
+	return result;
+}
+
+int truncateFAT64(Handle file, FAT_uint64_t new_size) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = getHandleDisk(file);
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = truncateFAT64Unlocked(file, new_size);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_TRUNCATE, getHandleDescriptor(file), 0, (FAT_int64_t)new_size, result, NULL, NULL);
+	return result;
+}
+
+int submitBatchFAT(FAT fat, BatchOperation* operations, int count) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = submitBatchFATUnlocked(fat, operations, count);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceBatch(backing_disk, start, operations, count, result);
+	return result;
+}
+
+int createDirFAT(FAT fat, const char* dirname) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = createDirFATUnlocked(fat, dirname);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_CREATE_DIR, -1, 0, 0, result, dirname, NULL);
+	return result;
+}
+
+int eraseDirFAT(FAT fat, const char* dirname) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = eraseDirFATUnlocked(fat, dirname);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_ERASE_DIR, -1, 0, 0, result, dirname, NULL);
+	return result;
+}
+
+int eraseTreeFAT(FAT fat, const char* dirname) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = eraseTreeFATUnlocked(fat, dirname);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_ERASE_TREE, -1, 0, 0, result, dirname, NULL);
+	return result;
+}
+
+int renameFAT(FAT fat, const char* filename, const char* new_filename) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = renameFATUnlocked(fat, filename, new_filename);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_RENAME, -1, 0, 0, result, filename, new_filename);
+	return result;
+}
+
+int moveFAT(FAT fat, const char* filename, const char* dest_dirname) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = moveFATUnlocked(fat, filename, dest_dirname);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_MOVE, -1, 0, 0, result, filename, dest_dirname);
+	return result;
+}
 
-static DirectoryElement* copyBufferToHeapAllocatedArray(const DirectoryElement* folders, size_t size) {
-	DirectoryElement* arr = (DirectoryElement*)malloc(size * sizeof(DirectoryElement));
-	memcpy(arr, folders, size * sizeof(DirectoryElement));
-	return arr;
+int changeDirFAT(FAT fat, const char* new_dirname) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = changeDirFATUnlocked(fat, new_dirname);
+	unlockDisk(backing_disk, 0);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_CHANGE_DIR, -1, 0, 0, result, new_dirname, NULL);
+	return result;
 }
 
 DirectoryElement* listDirFAT(FAT fat) {
-	size_t i;
-	DirectoryEntry* current_directory;
-	DirectoryEntry* current_child_entry;
+	DirectoryElement* result;
+	FAT_uint64_t start;
 	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
-	current_directory = getEntryFromIndex(backing_disk->current_working_directory);
-	for(i = 0; i < current_directory->num_children;) {
-		if(current_directory->children[i] != DELETED_CHILD_ENTRY) {
-			current_child_entry = getEntryFromIndex(current_directory->children[i]);
-			tmp_folders[i].filename = current_child_entry->filename;
-			tmp_folders[i].file_type = (DirectoryEntryType)current_child_entry->file_type;
-		}
-		++i;
-	}
-	tmp_folders[i].filename = NULL;
-	return copyBufferToHeapAllocatedArray(tmp_folders, i + 1);
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return NULL;
+	result = listDirFATUnlocked(fat);
+	unlockDisk(backing_disk, 0);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_LIST_DIR, -1, 0, 0, result != NULL ? 0 : -1, NULL, NULL);
+	return result;
 }
 
-void freeDirList(DirectoryElement* list) {
-	if(list)
-		free(list);
+int findFAT(FAT fat, const char* pattern, FindMode mode, FindCallback callback, void* user_data) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = findFATUnlocked(fat, pattern, mode, callback, user_data);
+	unlockDisk(backing_disk, 0);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_FIND, -1, (int)mode, 0, result, pattern, NULL);
+	return result;
+}
+
+int scrubFAT(FAT fat, int threads, ScrubReport* report) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = scrubFATUnlocked(fat, threads, report);
+	unlockDisk(backing_disk, 0);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_SCRUB, -1, threads, 0, result, NULL, NULL);
+	return result;
+}
+
+int statDirFAT(FAT fat, const char* dirname, DirectoryStats* stats) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = statDirFATUnlocked(fat, dirname, stats);
+	unlockDisk(backing_disk, 0);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_STAT_DIR, -1, 0, 0, result, dirname, NULL);
+	return result;
 }
 
+int setDirQuotaFAT(FAT fat, const char* dirname, FAT_uint64_t max_size, FAT_uint32_t max_entries) {
+	int result;
+	FAT_uint64_t start;
+	FATBackingDisk* backing_disk = (FATBackingDisk*)fat;
+	start = beginTrace(backing_disk);
+	if(lockDisk(backing_disk) == -1)
+		return -1;
+	result = setDirQuotaFATUnlocked(fat, dirname, max_size, max_entries);
+	unlockDisk(backing_disk, 1);
+	if(backing_disk->trace != NULL)
+		traceCall(backing_disk, start, TRACE_SET_QUOTA, -1, (int)max_entries, (FAT_int64_t)max_size, result, dirname, NULL);
+	return result;
+}
@@ -7,6 +7,16 @@ typedef short FAT_int16_t;
 typedef unsigned short FAT_uint16_t;
 typedef int FAT_int32_t;
 typedef unsigned int FAT_uint32_t;
+#ifdef _MSC_VER
+typedef __int64 FAT_int64_t;
+typedef unsigned __int64 FAT_uint64_t;
+#else
+/*
+* long long isn't part of c89, but every supported compiler provides it
+*/
+__extension__ typedef long long FAT_int64_t;
+__extension__ typedef unsigned long long FAT_uint64_t;
+#endif
 
 /*
 * Handle representing a virtual disk that was opened by the program.
@@ -32,7 +42,16 @@ typedef enum SeekWhence {
 	/*
 	* Seeks starting from the end of the file (positive values go "back" in the file)
 	*/
-	FAT_SEEK_END
+	FAT_SEEK_END,
+	/*
+	* Seeks to the first position at or after the offset holding data
+	*/
+	FAT_SEEK_DATA,
+	/*
+	* Seeks to the first position at or after the offset that is in a hole,
+	* the end of the file counts as a hole
+	*/
+	FAT_SEEK_HOLE
 } SeekWhence;
 
 typedef enum DirectoryEntryType {
@@ -40,11 +59,188 @@ typedef enum DirectoryEntryType {
 	FAT_DIRECTORY
 } DirectoryEntryType;
 
+/*
+* How findFAT compares the names with the passed pattern.
+*/
+typedef enum FindMode {
+	FAT_FIND_EXACT,
+	FAT_FIND_PREFIX,
+	/*
+	* The pattern is a shell wildcard pattern, as used by fnmatch
+	*/
+	FAT_FIND_GLOB
+} FindMode;
+
+/*
+* Called by findFAT for every match with its full path starting from the root,
+* the path is only valid until the callback returns.
+* Returning a nonzero value stops the search.
+*/
+typedef int (*FindCallback)(const char* path, DirectoryEntryType file_type, void* user_data);
+
+/*
+* How the checksums of the blocks are used, see setChecksumModeFAT.
+*/
+typedef enum ChecksumMode {
+	/*
+	* No checksum is computed or verified
+	*/
+	FAT_CHECKSUM_OFF,
+	/*
+	* Each block is verified the first time it's read after the disk is opened
+	*/
+	FAT_CHECKSUM_LAZY,
+	/*
+	* A fraction of the block reads is verified
+	*/
+	FAT_CHECKSUM_SAMPLED,
+	/*
+	* Every block read is verified
+	*/
+	FAT_CHECKSUM_ALWAYS
+} ChecksumMode;
+
 typedef struct DirectoryElement {
 	const char* filename;
 	DirectoryEntryType file_type;
 } DirectoryElement;
 
+/*
+* Result of a deduplication pass done by dedupFAT.
+*/
+typedef struct DedupReport {
+	/*
+	* Number of blocks that were compared
+	*/
+	FAT_uint32_t scanned_blocks;
+	/*
+	* Number of blocks that were freed because their contents were shared
+	* with another identical block
+	*/
+	FAT_uint32_t shared_blocks;
+	size_t saved_bytes;
+} DedupReport;
+
+/*
+* Result of a verification pass done by scrubFAT.
+*/
+typedef struct ScrubReport {
+	/*
+	* Number of used blocks that were verified against their checksum
+	*/
+	FAT_uint32_t checked_blocks;
+	/*
+	* Number of used blocks with no checksum, written while the checksums were off
+	*/
+	FAT_uint32_t unknown_blocks;
+	/*
+	* Number of blocks whose contents don't match their checksum
+	*/
+	FAT_uint32_t corrupted_blocks;
+	/*
+	* Nonzero if the FAT and directory tables didn't match their checksum
+	* when the disk was opened
+	*/
+	int metadata_corrupted;
+} ScrubReport;
+
+/*
+* A buffer used by readvFAT and writevFAT.
+*/
+typedef struct IoVector {
+	void* base;
+	size_t length;
+} IoVector;
+
+typedef enum BatchOperationType {
+	/*
+	* Creates the file, or empties it if it already exists, then writes the data
+	*/
+	FAT_BATCH_CREATE,
+	/*
+	* Writes the data to an already existing file
+	*/
+	FAT_BATCH_WRITE,
+	FAT_BATCH_ERASE
+} BatchOperationType;
+
+/*
+* A single operation submitted to submitBatchFAT.
+*/
+typedef struct BatchOperation {
+	BatchOperationType type;
+	/*
+	* Name of the file in the current working directory
+	*/
+	const char* filename;
+	/*
+	* Data written at *offset* by FAT_BATCH_CREATE and FAT_BATCH_WRITE
+	*/
+	const void* data;
+	size_t size;
+	FAT_uint64_t offset;
+	/*
+	* Set by submitBatchFAT to 0 on success, or to the errno value of the failure
+	*/
+	int result;
+} BatchOperation;
+
+/*
+* Totals of a directory, kept up to date as the files below it change, filled by statDirFAT.
+*/
+typedef struct DirectoryStats {
+	/*
+	* Sum of the sizes of all the files below the directory, at any depth
+	*/
+	FAT_uint64_t size;
+	/*
+	* Number of files and directories below the directory, at any depth
+	*/
+	FAT_uint32_t total_entries;
+	/*
+	* Quotas set with setDirQuotaFAT, 0 if unlimited
+	*/
+	FAT_uint64_t max_size;
+	FAT_uint32_t max_entries;
+} DirectoryStats;
+
+/*
+* Thresholds of the flusher thread started by startFlusherFAT, the changed parts
+* of the disk are written back as soon as either of them is crossed.
+*/
+typedef struct FlushPolicy {
+	/*
+	* Number of changed blocks
+	*/
+	FAT_uint32_t max_dirty_blocks;
+	/*
+	* Milliseconds since the oldest change that wasn't written back yet
+	*/
+	FAT_uint32_t max_dirty_age_ms;
+} FlushPolicy;
+
+/*
+* Counters of the flusher thread, filled by getFlushStatsFAT.
+*/
+typedef struct FlushStats {
+	FAT_uint64_t flushes;
+	/*
+	* Flushes started by max_dirty_blocks and by max_dirty_age_ms respectively
+	*/
+	FAT_uint64_t volume_flushes;
+	FAT_uint64_t age_flushes;
+	FAT_uint64_t flushed_blocks;
+	/*
+	* Nanoseconds spent writing back, in total and by the slowest flush
+	*/
+	FAT_uint64_t flush_time;
+	FAT_uint64_t max_flush_time;
+	/*
+	* Blocks changed since the last flush
+	*/
+	FAT_uint32_t dirty_blocks;
+} FlushStats;
+
 /*
 * Creates or opens a virtual disk at the provided path.
 * If anew is a nonzero value and a file with the passed name already exists,
@@ -52,18 +248,67 @@ typedef struct DirectoryElement {
 * a new disk is created (overwritting the already existing file in case).
 * If a file with that name already exists, and anew is 0, that file is opened as a disk
 * Returns a FAT handle to the opened disk on success
-* NULL on error.
+* NULL on error, with errno set to EBUSY if anew is nonzero and the disk is
+* still mounted with initSharedFAT.
 */
 FAT initFAT(const char* diskname, int anew);
 
+/*
+* Same as initFAT, for a disk that is going to be used by several processes at the same time.
+* Every function using the disk locks it with a mutex stored in the disk file, that
+* stays usable if a process dies while holding it, and the changes done by one
+* process are seen by all the others.
+* A process whose working directory was removed by another one is moved back to the root.
+* All the processes using the disk must open it with this function, and only the
+* first one can pass a nonzero anew.
+* The same disk can be mounted more than once by a process, each mount counts
+* as a separate one.
+* Returns a FAT handle to the opened disk on success
+* NULL on error, with errno set to EBUSY if anew is nonzero and the disk is
+* already mounted.
+*/
+FAT initSharedFAT(const char* diskname, int anew);
+
 /*
 * Frees all the resources and flushes pending changes for the passed FAT
 * handle.
-* No file Handle or DirectoryElement array is freed by this function, they
-* MUST be manually freed under any circumstance.
+* File handles and descriptors that are still open are closed, they must not be
+* used or freed afterwards.
+* No DirectoryElement array is freed by this function, they MUST be manually
+* freed under any circumstance.
 */
 int terminateFAT(FAT fat);
 
+/*
+* Creates a point in time copy of the passed FAT in a new disk file at the
+* provided path, and opens it read only.
+* Where the host filesystem supports it, the copy shares the unchanged data
+* with the original disk file (reflink), so the snapshot is almost instant
+* and only costs space for what's changed afterwards in either of the two.
+* Every function modifying the returned FAT fails with errno set to EROFS.
+* The snapshot file is kept after terminateFAT and can be opened again as a
+* regular disk with initFAT.
+* Returns a FAT handle to the snapshot on success
+* NULL on error.
+*/
+FAT snapshotFAT(FAT fat, const char* snapshot_name);
+
+/*
+* Starts recording every call made on the passed FAT, with its arguments, result
+* and duration, in a new binary trace file at the provided path, that can be
+* replayed on a new disk with fat_replay.
+* The data read and written isn't recorded, only its size.
+* Returns -1 on error, with errno set to EBUSY if a trace is already running.
+*/
+int startTraceFAT(FAT fat, const char* trace_name);
+
+/*
+* Stops the trace started by startTraceFAT and closes its file, terminateFAT
+* also stops it.
+* Returns -1 on error.
+*/
+int stopTraceFAT(FAT fat);
+
 /*
 * Creates or open a file in the given fat with the passed name.
 * The file is located in the current working directory set by changeDirFAT.
@@ -77,9 +322,36 @@ Handle createFileFAT(FAT fat, const char* filename);
 */
 void freeHandle(Handle handle);
 
+/*
+* Same as createFileFAT, returning a small non negative integer descriptor
+* instead of a Handle.
+* The handles are kept in a table owned by the FAT, and the descriptors of
+* closed files are reused, so opening and closing files doesn't allocate memory
+* once the table is big enough.
+* Returns the descriptor on success, -1 on error.
+* The descriptor has to be closed by closeFileFAT.
+*/
+int openFileFAT(FAT fat, const char* filename);
+
+/*
+* Returns the Handle corresponding to the passed descriptor, to be used with
+* the other file functions, it stays valid until the descriptor is closed.
+* Returns NULL and sets errno to EBADF if the descriptor isn't open.
+*/
+Handle getHandleFAT(FAT fat, int descriptor);
+
+/*
+* Closes the passed descriptor, freeHandle on its Handle does the same.
+* Returns 0 on success.
+* Returns -1 and sets errno to EBADF if the descriptor isn't open.
+*/
+int closeFileFAT(FAT fat, int descriptor);
+
 /*
 * Erases a file in the current working directory corresponding to the passed
 * name.
+* The blocks used by the file are given back to the host filesystem
+* (by punching holes in the disk file) where supported.
 * Returns 0 on success.
 * Returns -1 on error.
 */
@@ -92,24 +364,138 @@ int eraseFileFAT(FAT fat, const char* filename);
 */
 int eraseFileFATAt(Handle file);
 
+/*
+* Creates a file named dst_filename in the current working directory with the
+* same contents as the file named src_filename, without copying its data.
+* The two files share their blocks until either of them is written to, then
+* the written blocks (and the ones preceding them in the file) are copied.
+* Returns 0 on success.
+* Returns -1 on error, setting errno to ENOENT if the source file doesn't exist
+* or to EEXIST if the destination file already exists.
+*/
+int cloneFileFAT(FAT fat, const char* src_filename, const char* dst_filename);
+
+/*
+* Scans all the files in the given fat looking for identical blocks, and makes
+* them share a single copy, the same way as cloneFileFAT does.
+* Since a block also holds the position of the following one, only blocks
+* whose following blocks end up being shared as well can be merged, so this
+* mostly deduplicates identical files and files with identical endings.
+* The outcome is stored in *report*.
+* Returns 0 on success.
+* Returns -1 on error.
+*/
+int dedupFAT(FAT fat, DedupReport* report);
+
+/*
+* Compresses the file with the passed name in the current working directory.
+* The file is split in clusters of a few blocks that are compressed
+* independently, so seeking and reading at any position only needs to
+* decompress the cluster containing it.
+* The file goes back to being stored uncompressed on the first write to it.
+* Files that wouldn't use at least one block less once compressed are left as
+* they are.
+* Returns 0 on success.
+* Returns -1 on error.
+*/
+int compressFileFAT(FAT fat, const char* filename);
+
 /*
 * Writes *size* bytes from *in* to the passed file handle.
+* At most INT_MAX bytes are written by a single call, use writeFAT64 for bigger writes.
 * Returns the number of written bytes.
 */
 int writeFAT(Handle to, const void* in, size_t size);
 
+/*
+* Same as writeFAT, without the limit on the size of a single write.
+* Writing past the maximum file size (a bit less than 2 TiB) stops there and
+* sets errno to EFBIG.
+*/
+FAT_int64_t writeFAT64(Handle to, const void* in, size_t size);
+
 /*
 * Reads at most *size* bytes from the passed file handle 
 * and writes them in the *out* buffer.
+* At most INT_MAX bytes are read by a single call, use readFAT64 for bigger reads.
 * Returns the number of read bytes.
 */
 int readFAT(Handle from, void* out, size_t size);
 
+/*
+* Same as readFAT, without the limit on the size of a single read.
+*/
+FAT_int64_t readFAT64(Handle from, void* out, size_t size);
+
+/*
+* Reads into the *count* passed buffers in order, as if readFAT64 was called on each of them,
+* stopping at the end of the file.
+* Returns the total number of read bytes.
+*/
+FAT_int64_t readvFAT(Handle from, const IoVector* vectors, int count);
+
+/*
+* Writes the *count* passed buffers in order, as if writeFAT64 was called on each of them.
+* Returns the total number of written bytes.
+*/
+FAT_int64_t writevFAT(Handle to, const IoVector* vectors, int count);
+
 /*
 * Change the position of the cursor in the passed file handle.
+* The cursor can be moved past the end of the file, writing there leaves a hole
+* between the old end of the file and the written data, holes read as zeros and
+* don't use any block.
+* With FAT_SEEK_DATA and FAT_SEEK_HOLE, offset is the position to start looking from,
+* if it's past the end of the file, -1 is returned and errno is set to ENXIO.
+* Returns 0 on success.
+* Returns -1 on error.
 */
 int seekFAT(Handle file, FAT_int32_t offset, SeekWhence whence);
 
+/*
+* Same as seekFAT, with a 64 bit offset.
+* Returns -1 and sets errno to EFBIG if the new position is past the maximum file size.
+*/
+int seekFAT64(Handle file, FAT_int64_t offset, SeekWhence whence);
+
+/*
+* Returns the position of the cursor in the passed file handle.
+* If the position doesn't fit in 32 bits, (FAT_uint32_t)~0 is returned and errno
+* is set to EOVERFLOW, use tellFAT64 for files bigger than 4 GiB.
+*/
+FAT_uint32_t tellFAT(Handle file);
+
+/*
+* Same as tellFAT, returning the full 64 bit position.
+*/
+FAT_uint64_t tellFAT64(Handle file);
+
+/*
+* Changes the size of the file associated to the provided handle to *new_size*.
+* Shrinking the file frees all the blocks past the new end at once, growing it
+* leaves a hole between the old and the new end.
+* The position of the cursor of every handle to the file is left as it is,
+* even if it ends up past the end of the file.
+* Returns 0 on success.
+* Returns -1 on error.
+*/
+int truncateFAT(Handle file, FAT_uint32_t new_size);
+
+/*
+* Same as truncateFAT, with a 64 bit size.
+*/
+int truncateFAT64(Handle file, FAT_uint64_t new_size);
+
+/*
+* Runs the *count* passed operations in order on files in the current working directory,
+* looking up the free directory entries once for the whole batch and giving the blocks
+* freed by consecutive erases back to the host all at once.
+* A failed operation doesn't stop the following ones, its result field tells why it failed.
+* Returns the number of failed operations.
+* Returns -1 on error.
+*/
+int submitBatchFAT(FAT fat, BatchOperation* operations, int count);
+
 /*
 * Creates a directory in the given fat with the passed name.
 * The folder is located in the current working directory set by changeDirFAT.
@@ -126,6 +512,38 @@ int createDirFAT(FAT fat, const char* dirname);
 */
 int eraseDirFAT(FAT fat, const char* dirname);
 
+/*
+* Erases a directory in the current working directory corresponding to the passed
+* name, together with all the files and directories it contains.
+* All the blocks used by those files are freed in a single pass.
+* Handles to the erased files must not be used anymore, they still have to be freed.
+* Returns 0 on success.
+* Returns -1 on error.
+*/
+int eraseTreeFAT(FAT fat, const char* dirname);
+
+/*
+* Renames a file or directory in the current working directory.
+* Returns 0 on success.
+* Returns -1 on error, setting errno to ENOENT if no element with such name exists,
+* to EEXIST if an element named new_filename already exists, or to EINVAL if
+* new_filename is empty, ".", ".." or contains a slash or backslash.
+*/
+int renameFAT(FAT fat, const char* filename, const char* new_filename);
+
+/*
+* Moves a file or directory in the current working directory to the directory
+* dest_dirname, without copying any data, open handles to a moved file stay valid.
+* dest_dirname is a list of directory names separated by / or \\ relative to the
+* current working directory, or to the root of the filesystem if it starts with
+* a separator, .. corresponds to the parent directory.
+* Returns 0 on success.
+* Returns -1 on error, setting errno to ENOENT if either of the two doesn't exist,
+* to EEXIST if the destination already has an element with the same name,
+* or to EINVAL if a directory would be moved inside itself.
+*/
+int moveFAT(FAT fat, const char* filename, const char* dest_dirname);
+
 /*
 * Changes the current working directory to the provided one.
 * Valid directory names are directories that are children of the current working directory,
@@ -149,4 +567,99 @@ DirectoryElement* listDirFAT(FAT fat);
 */
 void freeDirList(DirectoryElement* list);
 
+/*
+* Looks for the files and directories anywhere in the disk whose name matches
+* *pattern*, calling *callback* for each of them in name order.
+* Only the names are matched, not the full paths.
+* The names are kept in a sorted index rebuilt after they change, so a search
+* doesn't walk the directory tree.
+* Returns the number of matches passed to the callback.
+* Returns -1 on error.
+*/
+int findFAT(FAT fat, const char* pattern, FindMode mode, FindCallback callback, void* user_data);
+
+/*
+* Stores in *stats* the totals of the directory at the passed path, relative to the
+* current working directory unless it starts with /, without walking its contents.
+* Returns 0 on success.
+* Returns -1 on error, setting errno to ENOENT if the directory doesn't exist.
+*/
+int statDirFAT(FAT fat, const char* dirname, DirectoryStats* stats);
+
+/*
+* Limits the sum of the sizes of the files and the number of files and directories
+* below the directory at the passed path, 0 meaning unlimited.
+* Writes, truncates, creations, clones and moves that would go over the quota of a
+* directory or of any directory containing it fail with errno set to EDQUOT,
+* writes are cut short at the quota like at the end of the disk.
+* The totals already over a new quota are kept, only their growth is prevented.
+* Returns 0 on success.
+* Returns -1 on error, setting errno to ENOENT if the directory doesn't exist.
+*/
+int setDirQuotaFAT(FAT fat, const char* dirname, FAT_uint64_t max_size, FAT_uint32_t max_entries);
+
+/*
+* Sets how the CRC32C checksums of the blocks are used by the passed FAT.
+* Unless the mode is FAT_CHECKSUM_OFF (the default), the checksum of every
+* block is updated when it's written, and reads verify it according to the mode,
+* failing with errno set to EIO on a mismatch.
+* With FAT_CHECKSUM_LAZY on a disk that isn't shared, the checksums of the written
+* blocks are only computed by terminateFAT, scrubFAT, snapshotFAT or when the mode
+* is changed, so a block written many times is hashed once.
+* The checksum of the FAT and directory tables is checked when the disk is
+* opened and updated by terminateFAT.
+*/
+void setChecksumModeFAT(FAT fat, ChecksumMode mode);
+
+/*
+* Verifies every used block of the passed FAT against its checksum, splitting
+* the disk between *threads* threads.
+* The outcome is stored in *report*.
+* Returns 0 on success.
+* Returns -1 on error.
+*/
+int scrubFAT(FAT fat, int threads, ScrubReport* report);
+
+/*
+* Starts a thread writing back the blocks and tables changed through the passed FAT
+* in the background, according to *policy*, so that the writes don't wait for
+* the disk and terminateFAT has little left to write.
+* Returns 0 on success.
+* Returns -1 on error, setting errno to EBUSY if the flusher is already running,
+* or to EINVAL if a threshold of the policy is 0.
+*/
+int startFlusherFAT(FAT fat, const FlushPolicy* policy);
+
+/*
+* Writes back what's still changed and stops the flusher thread, called by terminateFAT.
+* Returns 0 on success, or if the flusher wasn't running.
+* Returns -1 on error.
+*/
+int stopFlusherFAT(FAT fat);
+
+/*
+* Stores the counters of the flusher thread in *stats*, all zeros if it was never started.
+*/
+void getFlushStatsFAT(FAT fat, FlushStats* stats);
+
+/*
+* Reads a tar archive from *descriptor* until its end, creating its directories
+* and regular files in the current working directory of the disk, other entries
+* are skipped.
+* The archive is read in one pass through a fixed size buffer, so it can come
+* from a pipe, and the blocks of zeros of the files are left as holes.
+* Supports ustar, GNU long names and sizes, and the path and size pax attributes.
+* Returns the number of imported files and directories.
+* Returns -1 on error, setting errno to EINVAL if the archive is malformed.
+*/
+int importTarFAT(FAT fat, int descriptor);
+
+/*
+* Writes the contents of the current working directory of the disk to *descriptor*
+* as a tar archive, in one pass through a fixed size buffer.
+* Returns 0 on success.
+* Returns -1 on error.
+*/
+int exportTarFAT(FAT fat, int descriptor);
+
 #endif /*FAT_H*/
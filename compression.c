@@ -0,0 +1,151 @@
+#include "compression.h"
+#include "FAT.h" /*FAT_uint32_t*/
+#include <string.h> /*memcpy, memset*/
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 0xFFFF
+#define HASH_LOG 12
+#define LENGTH_MASK 15
+
+#define hashSequence(sequence) ((FAT_uint32_t)((sequence) * 2654435761UL) >> (32 - HASH_LOG))
+
+static FAT_uint32_t read32(const unsigned char* in) {
+	FAT_uint32_t value;
+	memcpy(&value, in, sizeof(value));
+	return value;
+}
+
+/*
+* Writes the part of a length that didn't fit in its 4 bits of the token.
+*/
+static int writeLength(unsigned char** out, const unsigned char* out_end, size_t length) {
+	for(; length >= 255; length -= 255) {
+		if(*out >= out_end)
+			return -1;
+		*((*out)++) = 255;
+	}
+	if(*out >= out_end)
+		return -1;
+	*((*out)++) = (unsigned char)length;
+	return 0;
+}
+
+/*
+* Every sequence is made of a token (4 bits of literal length and 4 bits of
+* match length), the literals, and the 2 bytes offset of the match.
+* The last sequence only has literals.
+*/
+static int writeSequence(unsigned char** out, const unsigned char* out_end, const unsigned char* literals, size_t literal_length, size_t offset, size_t match_length) {
+	unsigned char* token = *out;
+	size_t match_code = match_length - MIN_MATCH;
+	if(*out >= out_end)
+		return -1;
+	++(*out);
+	*token = (unsigned char)((literal_length < LENGTH_MASK ? literal_length : LENGTH_MASK) << 4);
+	if(literal_length >= LENGTH_MASK && writeLength(out, out_end, literal_length - LENGTH_MASK) != 0)
+		return -1;
+	if((size_t)(out_end - *out) < literal_length)
+		return -1;
+	memcpy(*out, literals, literal_length);
+	*out += literal_length;
+	if(match_length == 0)
+		return 0;
+	if(out_end - *out < 2)
+		return -1;
+	*((*out)++) = (unsigned char)(offset & 0xFF);
+	*((*out)++) = (unsigned char)(offset >> 8);
+	*token |= (unsigned char)(match_code < LENGTH_MASK ? match_code : LENGTH_MASK);
+	if(match_code >= LENGTH_MASK && writeLength(out, out_end, match_code - LENGTH_MASK) != 0)
+		return -1;
+	return 0;
+}
+
+size_t compressBuffer(const void* in, size_t in_size, void* out, size_t out_capacity) {
+	/*
+	* Position + 1 of the last occurrence of each hashed 4 bytes sequence
+	*/
+	size_t table[1 << HASH_LOG];
+	const unsigned char* src = (const unsigned char*)in;
+	unsigned char* dst = (unsigned char*)out;
+	const unsigned char* dst_end = dst + out_capacity;
+	size_t pos = 0;
+	size_t anchor = 0;
+	size_t candidate;
+	size_t match_length;
+	FAT_uint32_t sequence;
+	FAT_uint32_t hash;
+	memset(table, 0, sizeof(table));
+	while(pos + MIN_MATCH <= in_size) {
+		sequence = read32(src + pos);
+		hash = hashSequence(sequence);
+		candidate = table[hash];
+		table[hash] = pos + 1;
+		if(candidate == 0 || pos - (candidate - 1) > MAX_OFFSET || read32(src + candidate - 1) != sequence) {
+			++pos;
+			continue;
+		}
+		--candidate;
+		match_length = MIN_MATCH;
+		while(pos + match_length < in_size && src[candidate + match_length] == src[pos + match_length])
+			++match_length;
+		if(writeSequence(&dst, dst_end, src + anchor, pos - anchor, pos - candidate, match_length) != 0)
+			return 0;
+		pos += match_length;
+		anchor = pos;
+	}
+	if(writeSequence(&dst, dst_end, src + anchor, in_size - anchor, 0, 0) != 0)
+		return 0;
+	return (size_t)(dst - (unsigned char*)out);
+}
+
+static int readLength(const unsigned char** in, const unsigned char* in_end, size_t* length) {
+	unsigned char cur;
+	do {
+		if(*in >= in_end)
+			return -1;
+		cur = *((*in)++);
+		*length += cur;
+	} while(cur == 255);
+	return 0;
+}
+
+int decompressBuffer(const void* in, size_t in_size, void* out, size_t out_size) {
+	const unsigned char* src = (const unsigned char*)in;
+	const unsigned char* src_end = src + in_size;
+	unsigned char* dst = (unsigned char*)out;
+	unsigned char* dst_end = dst + out_size;
+	unsigned char token;
+	size_t length;
+	size_t offset;
+	while(src < src_end) {
+		token = *(src++);
+		length = (size_t)(token >> 4);
+		if(length == LENGTH_MASK && readLength(&src, src_end, &length) != 0)
+			return -1;
+		if((size_t)(src_end - src) < length || (size_t)(dst_end - dst) < length)
+			return -1;
+		memcpy(dst, src, length);
+		src += length;
+		dst += length;
+		if(src == src_end)
+			break;
+		if(src_end - src < 2)
+			return -1;
+		offset = (size_t)src[0] | ((size_t)src[1] << 8);
+		src += 2;
+		if(offset == 0 || offset > (size_t)(dst - (unsigned char*)out))
+			return -1;
+		length = (size_t)(token & LENGTH_MASK);
+		if(length == LENGTH_MASK && readLength(&src, src_end, &length) != 0)
+			return -1;
+		length += MIN_MATCH;
+		if((size_t)(dst_end - dst) < length)
+			return -1;
+		/*
+		* The match can overlap with the bytes being written, so it has to be copied one byte at a time
+		*/
+		for(; length > 0; --length, ++dst)
+			*dst = *(dst - offset);
+	}
+	return dst == dst_end ? 0 : -1;
+}
@@ -0,0 +1,22 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+#include <stddef.h> /*size_t*/
+
+/*
+* Compresses in_size bytes from *in* into *out*, using an LZ77 scheme
+* with byte aligned tokens (in the style of LZ4).
+* Returns the size of the compressed data, or 0 if it doesn't fit in
+* out_capacity bytes.
+*/
+size_t compressBuffer(const void* in, size_t in_size, void* out, size_t out_capacity);
+
+/*
+* Decompresses in_size bytes from *in* into *out*, that must be big exactly
+* out_size bytes.
+* Returns 0 on success.
+* Returns -1 if the compressed data is malformed or doesn't decompress to
+* exactly out_size bytes.
+*/
+int decompressBuffer(const void* in, size_t in_size, void* out, size_t out_size);
+
+#endif /*COMPRESSION_H*/
@@ -0,0 +1,110 @@
+#include "crc32c.h"
+#include <string.h> /*memcpy*/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_HARDWARE
+#include <nmmintrin.h> /*_mm_crc32_u8, _mm_crc32_u32, _mm_crc32_u64*/
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82F63B78UL
+
+/*
+* Tables for the slicing by 8 fallback, table[n][byte] is the crc of the byte
+* followed by n zero bytes.
+*/
+static FAT_uint32_t crc_tables[8][256];
+
+typedef FAT_uint32_t(*Crc32cFunction)(FAT_uint32_t crc, const unsigned char* data, size_t size);
+
+static FAT_uint32_t crc32cSoftware(FAT_uint32_t crc, const unsigned char* data, size_t size) {
+	FAT_uint32_t low;
+	FAT_uint32_t high;
+	while(size > 0 && ((size_t)data & 3) != 0) {
+		crc = crc_tables[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+		--size;
+	}
+	while(size >= 8) {
+		/*the tables are built for little endian words*/
+		low = (FAT_uint32_t)data[0] | ((FAT_uint32_t)data[1] << 8) | ((FAT_uint32_t)data[2] << 16) | ((FAT_uint32_t)data[3] << 24);
+		high = (FAT_uint32_t)data[4] | ((FAT_uint32_t)data[5] << 8) | ((FAT_uint32_t)data[6] << 16) | ((FAT_uint32_t)data[7] << 24);
+		low ^= crc;
+		crc = crc_tables[7][low & 0xFF] ^ crc_tables[6][(low >> 8) & 0xFF] ^
+			  crc_tables[5][(low >> 16) & 0xFF] ^ crc_tables[4][low >> 24] ^
+			  crc_tables[3][high & 0xFF] ^ crc_tables[2][(high >> 8) & 0xFF] ^
+			  crc_tables[1][(high >> 16) & 0xFF] ^ crc_tables[0][high >> 24];
+		data += 8;
+		size -= 8;
+	}
+	while(size > 0) {
+		crc = crc_tables[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+		--size;
+	}
+	return crc;
+}
+
+#ifdef CRC32C_HARDWARE
+/*
+* The crc32 instruction from SSE4.2 implements exactly this polynomial.
+*/
+__attribute__((target("sse4.2")))
+static FAT_uint32_t crc32cHardware(FAT_uint32_t crc, const unsigned char* data, size_t size) {
+#ifdef __x86_64__
+	FAT_uint64_t word;
+	FAT_uint64_t crc64;
+#else
+	FAT_uint32_t word;
+#endif
+	while(size > 0 && ((size_t)data & (sizeof(word) - 1)) != 0) {
+		crc = _mm_crc32_u8(crc, *data++);
+		--size;
+	}
+#ifdef __x86_64__
+	crc64 = crc;
+	for(; size >= sizeof(word); size -= sizeof(word), data += sizeof(word)) {
+		memcpy(&word, data, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = (FAT_uint32_t)crc64;
+#else
+	for(; size >= sizeof(word); size -= sizeof(word), data += sizeof(word)) {
+		memcpy(&word, data, sizeof(word));
+		crc = _mm_crc32_u32(crc, word);
+	}
+#endif
+	while(size > 0) {
+		crc = _mm_crc32_u8(crc, *data++);
+		--size;
+	}
+	return crc;
+}
+#endif
+
+static Crc32cFunction crc32c_function = crc32cSoftware;
+
+void initCrc32c(void) {
+	FAT_uint32_t crc;
+	int byte;
+	int bit;
+	int slice;
+	if(crc_tables[0][1] == 0) {
+		for(byte = 0; byte < 256; ++byte) {
+			crc = (FAT_uint32_t)byte;
+			for(bit = 0; bit < 8; ++bit)
+				crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+			crc_tables[0][byte] = crc;
+		}
+		for(byte = 0; byte < 256; ++byte) {
+			for(slice = 1; slice < 8; ++slice)
+				crc_tables[slice][byte] = crc_tables[0][crc_tables[slice - 1][byte] & 0xFF] ^ (crc_tables[slice - 1][byte] >> 8);
+		}
+	}
+#ifdef CRC32C_HARDWARE
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2"))
+		crc32c_function = crc32cHardware;
+#endif
+}
+
+FAT_uint32_t crc32c(FAT_uint32_t crc, const void* data, size_t size) {
+	return ~crc32c_function(~crc, (const unsigned char*)data, size);
+}
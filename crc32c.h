@@ -0,0 +1,18 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+#include <stddef.h> /*size_t*/
+#include "FAT.h" /*FAT_uint32_t*/
+
+/*
+* Picks the fastest implementation supported by the running cpu,
+* must be called before crc32c.
+*/
+void initCrc32c(void);
+
+/*
+* Extends the CRC32C (Castagnoli) *crc* of the data preceding *data* with
+* the next *size* bytes, pass 0 as crc to start a new checksum.
+*/
+FAT_uint32_t crc32c(FAT_uint32_t crc, const void* data, size_t size);
+
+#endif /*CRC32C_H*/
@@ -8,8 +8,80 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h> /*open*/
+#include <stdlib.h>
+
+/*
+* Files smaller than this are read whole and written to the disk in batches
+*/
+#define SMALL_FILE_SIZE 65536
+#define MAX_BATCH_OPERATIONS 64
 
 static FAT fat;
+static int compress_files;
+static BatchOperation batch[MAX_BATCH_OPERATIONS];
+static int batch_size;
+
+static void freeBatchOperation(BatchOperation* operation) {
+	free((void*)operation->filename);
+	free((void*)operation->data);
+}
+
+/*
+* Writes the pending small files to the current working directory of the disk.
+*/
+static int flushBatch(void) {
+	int i;
+	int err = 0;
+	if(batch_size == 0)
+		return 0;
+	if(submitBatchFAT(fat, batch, batch_size) != 0)
+		err = 1;
+	for(i = 0; i < batch_size; ++i) {
+		if(batch[i].result != 0)
+			printf("failed to copy file: %s, error: %s\n", batch[i].filename, strerror(batch[i].result));
+		else if(compress_files && compressFileFAT(fat, batch[i].filename) != 0)
+			printf("failed to compress file: %s, error: %s, keeping it uncompressed\n", batch[i].filename, strerror(errno));
+		freeBatchOperation(&batch[i]);
+	}
+	batch_size = 0;
+	return err;
+}
+
+static int queueFile(char* name, size_t size) {
+	int fd;
+	ssize_t nread;
+	size_t total_read = 0;
+	char* filename;
+	char* data;
+	if(batch_size == MAX_BATCH_OPERATIONS && flushBatch() != 0)
+		return -1;
+	filename = (char*)malloc(strlen(name) + 1);
+	data = (char*)malloc(size > 0 ? size : 1);
+	if(filename == NULL || data == NULL) {
+		perror("failed to allocate memory");
+		goto error;
+	}
+	strcpy(filename, name);
+	fd = open(name, O_RDONLY);
+	if(fd == -1) {
+		perror("failed to open file");
+		goto error;
+	}
+	while(total_read < size && (nread = read(fd, data + total_read, size - total_read)) > 0)
+		total_read += (size_t)nread;
+	close(fd);
+	batch[batch_size].type = FAT_BATCH_CREATE;
+	batch[batch_size].filename = filename;
+	batch[batch_size].data = data;
+	batch[batch_size].size = total_read;
+	batch[batch_size].offset = 0;
+	++batch_size;
+	return 0;
+error:
+	free(filename);
+	free(data);
+	return -1;
+}
 
 static int insertFile(char* name) {
 	Handle handle;
@@ -38,6 +110,8 @@ static int insertFile(char* name) {
 	}
 	close(fd);
 	freeHandle(handle);
+	if(err == 0 && compress_files && compressFileFAT(fat, name) != 0)
+		printf("failed to compress file: %s, error: %s, keeping it uncompressed\n", name, strerror(errno));
 	return err;
 }
 
@@ -63,6 +137,9 @@ static int insertDirectory(char* name) {
 			continue;
 		stat(cur_dir->d_name, &current_file_stat);
 		if(S_ISDIR(current_file_stat.st_mode)) {
+			err = flushBatch();
+			if(err != 0)
+				break;
 			err = createDirFAT(fat, cur_dir->d_name);
 			if(err == -1) {
 				printf("failed to create folder: %s\n", cur_dir->d_name);
@@ -76,11 +153,17 @@ static int insertDirectory(char* name) {
 			err = insertDirectory(cur_dir->d_name);
 			changeDirFAT(fat, "..");
 		}
-		else if(S_ISREG(current_file_stat.st_mode))
-			err = insertFile(cur_dir->d_name);
+		else if(S_ISREG(current_file_stat.st_mode)) {
+			if(current_file_stat.st_size < SMALL_FILE_SIZE)
+				err = queueFile(cur_dir->d_name, (size_t)current_file_stat.st_size);
+			else
+				err = insertFile(cur_dir->d_name);
+		}
 		if(err != 0)
 			break;
 	}
+	if(flushBatch() != 0)
+		err = 1;
 	if(chdir("..") != 0) {
 		assert(0 && "failed to change to parent directory");
 	}
@@ -89,17 +172,63 @@ static int insertDirectory(char* name) {
 }
 
 int main(int argc, char** argv) {
+	int i;
 	int err;
-	if(argc < 2) {
-		puts("the first argument must be the folder to put in a \"virtual disk\" and the second must be the name for the disk");
+	int dedup = 0;
+	int checksum = 0;
+	int flusher = 0;
+	const char* trace_name = NULL;
+	DedupReport report;
+	FlushPolicy policy;
+	FlushStats stats;
+	if(argc < 3) {
+		puts("the first argument must be the folder to put in a \"virtual disk\" and the second must be the name for the disk, "
+			 "pass --dedup to share the identical blocks once the copy is done, --compress to compress the copied files, "
+			 "--checksum to store a checksum of every block and --trace followed by a file name to record the calls "
+			 "made to the disk in that file, to replay them with fat_replay, --flusher to write the copied data back "
+			 "to the disk file in the background while copying");
 		return 1;
 	}
+	for(i = 3; i < argc; ++i) {
+		if(strcmp(argv[i], "--dedup") == 0)
+			dedup = 1;
+		else if(strcmp(argv[i], "--compress") == 0)
+			compress_files = 1;
+		else if(strcmp(argv[i], "--checksum") == 0)
+			checksum = 1;
+		else if(strcmp(argv[i], "--flusher") == 0)
+			flusher = 1;
+		else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			trace_name = argv[++i];
+	}
 	fat = initFAT(argv[2], 1);
 	if(fat == NULL) {
 		perror("failed to initialize FAT");
 		return 1;
 	}
+	if(checksum)
+		setChecksumModeFAT(fat, FAT_CHECKSUM_LAZY);
+	if(trace_name != NULL && startTraceFAT(fat, trace_name) != 0)
+		perror("failed to start the trace");
+	policy.max_dirty_blocks = 128;
+	policy.max_dirty_age_ms = 100;
+	if(flusher && startFlusherFAT(fat, &policy) != 0)
+		perror("failed to start the flusher");
 	err = insertDirectory(argv[1]);
+	if(err == 0 && dedup) {
+		if(dedupFAT(fat, &report) == 0)
+			printf("deduplication scanned %u blocks, shared %u blocks, saving %lu bytes\n",
+				   report.scanned_blocks, report.shared_blocks, (unsigned long)report.saved_bytes);
+		else
+			perror("failed to deduplicate the disk");
+	}
+	if(flusher) {
+		if(stopFlusherFAT(fat) != 0)
+			perror("failed to write back the disk");
+		getFlushStatsFAT(fat, &stats);
+		printf("the flusher wrote back %lu blocks in %lu flushes, taking %lu ms\n", (unsigned long)stats.flushed_blocks,
+			   (unsigned long)stats.flushes, (unsigned long)(stats.flush_time / 1000000u));
+	}
 	if(terminateFAT(fat) != 0) {
 		assert(0 || (char*)"failed to free the resources");
 	}
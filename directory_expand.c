@@ -6,6 +6,7 @@
 #include <io.h>
 #include <sys/types.h>
 #define mkdir(name,mode) mkdir(name)
+#define ftruncate(fd,size) chsize(fd,size)
 typedef int ssize_t;
 #else
 #include <unistd.h>
@@ -23,24 +24,13 @@ typedef int ssize_t;
 
 static FAT fat;
 
-static int extractFile(const char* name) {
-	Handle handle;
-	int fd;
+static int copyFileRange(Handle handle, int fd, const char* name, FAT_uint64_t size) {
 	char buf[512];
 	char* out_ptr;
-	int err = 0;
 	int nread;
 	ssize_t nwritten;
-	if((handle = createFileFAT(fat, name)) == NULL) {
-		printf("failed to open file in FAT: %s\n", name);
-		return -1;
-	}
-	if((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) == -1) {
-		fprintf(stderr, "failed to create output file %s: %s\n", name, strerror(errno));
-		freeHandle(handle);
-		return -1;
-	}
-	while((nread = readFAT(handle, buf, sizeof(buf))) > 0) {
+	while(size > 0 && (nread = readFAT(handle, buf, (size_t)(size < sizeof(buf) ? size : sizeof(buf)))) > 0) {
+		size -= (FAT_uint64_t)nread;
 		out_ptr = buf;
 		do {
 			nwritten = write(fd, out_ptr, (size_t)nread);
@@ -50,12 +40,50 @@ static int extractFile(const char* name) {
 				out_ptr += nwritten;
 			} else if(errno != EINTR) {
 				fprintf(stderr, "failed to write output file %s: %s\n", name, strerror(errno));
-				err = 1;
-				goto on_error;
+				return 1;
 			}
 		} while(nread > 0);
 	}
-	on_error:
+	return 0;
+}
+
+/*
+* Only the ranges of the file holding data are copied, so that the holes
+* are kept in the output file as well.
+*/
+static int extractFile(const char* name) {
+	Handle handle;
+	int fd;
+	int err = 0;
+	FAT_uint64_t file_size;
+	FAT_uint64_t data_start;
+	FAT_uint64_t data_end;
+	if((handle = createFileFAT(fat, name)) == NULL) {
+		printf("failed to open file in FAT: %s\n", name);
+		return -1;
+	}
+	if((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666)) == -1) {
+		fprintf(stderr, "failed to create output file %s: %s\n", name, strerror(errno));
+		freeHandle(handle);
+		return -1;
+	}
+	seekFAT64(handle, 0, FAT_SEEK_END);
+	file_size = tellFAT64(handle);
+	for(data_start = 0; seekFAT64(handle, (FAT_int64_t)data_start, FAT_SEEK_DATA) == 0; data_start = data_end) {
+		data_start = tellFAT64(handle);
+		seekFAT64(handle, (FAT_int64_t)data_start, FAT_SEEK_HOLE);
+		data_end = tellFAT64(handle);
+		seekFAT64(handle, (FAT_int64_t)data_start, FAT_SEEK_SET);
+		if(lseek(fd, (off_t)data_start, SEEK_SET) == -1 ||
+		   copyFileRange(handle, fd, name, data_end - data_start) != 0) {
+			err = 1;
+			break;
+		}
+	}
+	if(err == 0 && ftruncate(fd, (off_t)file_size) != 0) {
+		fprintf(stderr, "failed to set the size of output file %s: %s\n", name, strerror(errno));
+		err = 1;
+	}
 	close(fd);
 	freeHandle(handle);
 	return err;
@@ -94,15 +122,29 @@ static int extractDirectory(const char* name) {
 
 int main(int argc, char** argv) {
 	int err;
-	if(argc < 2) {
-		puts("the first argument must be the \"virtual disk\" to expand and the second must be the name of the folder where this disk will be extracted to");
+	int i;
+	int verify = 0;
+	ScrubReport report;
+	if(argc < 3) {
+		puts("the first argument must be the \"virtual disk\" to expand and the second must be the name of the folder where this disk will be extracted to, "
+			 "pass --verify to check the disk against its checksums before and while extracting it");
 		return 1;
 	}
+	for(i = 3; i < argc; ++i) {
+		if(strcmp(argv[i], "--verify") == 0)
+			verify = 1;
+	}
 	fat = initFAT(argv[1], 0);
 	if(fat == NULL) {
 		perror("failed to initialize FAT");
 		return 1;
 	}
+	if(verify) {
+		setChecksumModeFAT(fat, FAT_CHECKSUM_ALWAYS);
+		scrubFAT(fat, 4, &report);
+		printf("verified %u blocks, %u without checksum, %u corrupted%s\n", report.checked_blocks, report.unknown_blocks,
+			   report.corrupted_blocks, report.metadata_corrupted ? ", the FAT and directory tables are corrupted" : "");
+	}
 
 	err = extractDirectory(argv[2]);
 	if(terminateFAT(fat) != 0) {
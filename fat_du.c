@@ -0,0 +1,40 @@
+#include "FAT.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char** argv) {
+	int err;
+	const char* dirname = "/";
+	DirectoryStats stats;
+	FAT fat;
+	if(argc < 2) {
+		puts("the first argument must be the name of the disk and the second, optional, the path of a directory in it, "
+			 "pass --quota followed by a size in bytes and a number of entries to limit the directory, 0 meaning unlimited");
+		return 1;
+	}
+	if(argc > 2 && strcmp(argv[2], "--quota") != 0)
+		dirname = argv[2];
+	fat = initFAT(argv[1], 0);
+	if(fat == NULL) {
+		perror("failed to open disk");
+		return 1;
+	}
+	err = 0;
+	if(argc > 4 && strcmp(argv[argc - 3], "--quota") == 0) {
+		err = setDirQuotaFAT(fat, dirname, (FAT_uint64_t)strtoul(argv[argc - 2], NULL, 10), (FAT_uint32_t)strtoul(argv[argc - 1], NULL, 10));
+		if(err == -1)
+			perror("failed to set the quota");
+	}
+	if(err == 0) {
+		err = statDirFAT(fat, dirname, &stats);
+		if(err == -1)
+			perror("failed to read the directory totals");
+		else
+			printf("%lu bytes, %lu entries, quota %lu bytes, %lu entries\n", (unsigned long)stats.size, (unsigned long)stats.total_entries,
+				   (unsigned long)stats.max_size, (unsigned long)stats.max_entries);
+	}
+	if(terminateFAT(fat) != 0)
+		perror("failed to close disk");
+	return err == -1 ? 1 : 0;
+}
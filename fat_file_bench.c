@@ -0,0 +1,83 @@
+#include "FAT.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FILE_SIZE 400000
+#define RANDOM_READS 200
+#define RANDOM_READ_SIZE 100
+
+static double getSeconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/*
+* Every iteration rewrites the whole file, reads it back, and then reads small
+* pieces of it scattered across the file.
+*/
+static int runBenchmark(FAT fat, int iterations) {
+	int i;
+	int j;
+	double start;
+	double elapsed;
+	FAT_uint64_t moved = 0;
+	static char buffer[FILE_SIZE];
+	Handle handle = createFileFAT(fat, "bench");
+	if(handle == NULL) {
+		perror("failed to create the file");
+		return 1;
+	}
+	memset(buffer, 'a', sizeof(buffer));
+	start = getSeconds();
+	for(i = 0; i < iterations; ++i) {
+		if(seekFAT64(handle, 0, FAT_SEEK_SET) != 0 || writeFAT64(handle, buffer, sizeof(buffer)) != (FAT_int64_t)sizeof(buffer))
+			goto error;
+		if(seekFAT64(handle, 0, FAT_SEEK_SET) != 0 || readFAT64(handle, buffer, sizeof(buffer)) != (FAT_int64_t)sizeof(buffer))
+			goto error;
+		moved += 2 * sizeof(buffer);
+		for(j = 0; j < RANDOM_READS; ++j) {
+			if(seekFAT64(handle, (FAT_int64_t)(j * 1931) % (FILE_SIZE - RANDOM_READ_SIZE), FAT_SEEK_SET) != 0 ||
+			   readFAT64(handle, buffer, RANDOM_READ_SIZE) != RANDOM_READ_SIZE)
+				goto error;
+			moved += RANDOM_READ_SIZE;
+		}
+	}
+	elapsed = getSeconds() - start;
+	printf("iterations: %d, seconds: %.3f, MiB/s: %.2f\n", iterations, elapsed, (double)moved / (1024.0 * 1024.0) / elapsed);
+	freeHandle(handle);
+	return 0;
+error:
+	perror("failed to access the file");
+	freeHandle(handle);
+	return 1;
+}
+
+int main(int argc, char** argv) {
+	int i;
+	int err;
+	int iterations = 3000;
+	FAT fat;
+	if(argc < 2) {
+		puts("the first argument must be the name of the disk to create, the optional second the number of iterations, "
+			 "pass --checksum to store a checksum of every block");
+		return 1;
+	}
+	fat = initFAT(argv[1], 1);
+	if(fat == NULL) {
+		perror("failed to create the disk");
+		return 1;
+	}
+	for(i = 2; i < argc; ++i) {
+		if(strcmp(argv[i], "--checksum") == 0)
+			setChecksumModeFAT(fat, FAT_CHECKSUM_LAZY);
+		else
+			iterations = atoi(argv[i]);
+	}
+	err = runBenchmark(fat, iterations);
+	if(terminateFAT(fat) != 0)
+		err = 1;
+	return err;
+}
@@ -0,0 +1,41 @@
+#include "FAT.h"
+#include <stdio.h>
+#include <string.h>
+
+static int printMatch(const char* path, DirectoryEntryType file_type, void* user_data) {
+	(void)user_data;
+	if(file_type == FAT_DIRECTORY)
+		printf("%s/\n", path);
+	else
+		printf("%s\n", path);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	int i;
+	int found;
+	FindMode mode = FAT_FIND_EXACT;
+	FAT fat;
+	if(argc < 3) {
+		puts("the first argument must be the name of the disk and the second the name to look for, "
+			 "pass --prefix to find the names starting with it or --glob to use it as a wildcard pattern");
+		return 1;
+	}
+	for(i = 3; i < argc; ++i) {
+		if(strcmp(argv[i], "--prefix") == 0)
+			mode = FAT_FIND_PREFIX;
+		else if(strcmp(argv[i], "--glob") == 0)
+			mode = FAT_FIND_GLOB;
+	}
+	fat = initFAT(argv[1], 0);
+	if(fat == NULL) {
+		perror("failed to open disk");
+		return 1;
+	}
+	found = findFAT(fat, argv[2], mode, printMatch, NULL);
+	if(found == -1)
+		perror("failed to search the disk");
+	if(terminateFAT(fat) != 0)
+		perror("failed to close disk");
+	return found > 0 ? 0 : 1;
+}
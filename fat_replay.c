@@ -0,0 +1,497 @@
+#include "FAT.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+typedef struct LatencyList {
+	FAT_uint64_t* values;
+	size_t count;
+	size_t capacity;
+} LatencyList;
+
+/*
+* Replays a single trace on its own mount of the disk, like the process that recorded it.
+*/
+typedef struct Replayer {
+	const char* trace_name;
+	TraceReader* trace;
+	FAT fat;
+	TraceRecord next;
+	int has_next;
+	/*
+	* Descriptor opened by the replay for each descriptor of the trace, -1 if none
+	*/
+	int* descriptors;
+	int total_descriptors;
+	char* buffer;
+	size_t buffer_size;
+	LatencyList latencies[TRACE_OPERATIONS_END];
+	FAT_uint64_t mismatches;
+	FAT_uint64_t bytes_read;
+	FAT_uint64_t bytes_written;
+	int failed;
+} Replayer;
+
+static const char* operation_names[TRACE_OPERATIONS_END] = {
+	NULL,
+	"open",
+	"close",
+	"erase",
+	"erase at",
+	"clone",
+	"dedup",
+	"compress",
+	"write",
+	"read",
+	"writev",
+	"readv",
+	"seek",
+	"truncate",
+	"batch",
+	NULL,
+	"create dir",
+	"erase dir",
+	"erase tree",
+	"rename",
+	"move",
+	"change dir",
+	"list dir",
+	"find",
+	"scrub",
+	"snapshot",
+	"stat dir",
+	"set quota"
+};
+
+static int addLatency(LatencyList* list, FAT_uint64_t latency) {
+	FAT_uint64_t* values;
+	if(list->count == list->capacity) {
+		values = (FAT_uint64_t*)realloc(list->values, (list->capacity * 2 + 64) * sizeof(FAT_uint64_t));
+		if(values == NULL)
+			return -1;
+		list->values = values;
+		list->capacity = list->capacity * 2 + 64;
+	}
+	list->values[list->count++] = latency;
+	return 0;
+}
+
+static int compareLatencies(const void* a, const void* b) {
+	FAT_uint64_t first = *(const FAT_uint64_t*)a;
+	FAT_uint64_t second = *(const FAT_uint64_t*)b;
+	return first < second ? -1 : first > second;
+}
+
+/*
+* The list must be sorted.
+*/
+static double getPercentile(const LatencyList* list, double percentile) {
+	size_t rank = (size_t)(percentile * (double)list->count / 100.0);
+	if(rank >= list->count)
+		rank = list->count - 1;
+	return (double)list->values[rank] / 1000.0;
+}
+
+static void printLatencies(const char* name, LatencyList* list) {
+	if(list->count == 0)
+		return;
+	qsort(list->values, list->count, sizeof(FAT_uint64_t), compareLatencies);
+	printf("%-12s %10lu %10.2f %10.2f %10.2f %10.2f %10.2f\n", name, (unsigned long)list->count,
+		   getPercentile(list, 50), getPercentile(list, 90), getPercentile(list, 99), getPercentile(list, 99.9),
+		   (double)list->values[list->count - 1] / 1000.0);
+}
+
+static int readNextRecord(Replayer* replayer) {
+	int err = readTraceRecord(replayer->trace, &replayer->next);
+	if(err == -1) {
+		fprintf(stderr, "failed to read the trace %s: %s\n", replayer->trace_name, strerror(errno));
+		replayer->failed = 1;
+	}
+	replayer->has_next = err == 1;
+	return err;
+}
+
+/*
+* The contents of the data written by the trace aren't recorded, a fixed pattern is written instead.
+*/
+static char* getBuffer(Replayer* replayer, FAT_int64_t size) {
+	char* buffer;
+	if((size_t)size > replayer->buffer_size) {
+		buffer = (char*)realloc(replayer->buffer, (size_t)size);
+		if(buffer == NULL)
+			return NULL;
+		memset(buffer + replayer->buffer_size, 'x', (size_t)size - replayer->buffer_size);
+		replayer->buffer = buffer;
+		replayer->buffer_size = (size_t)size;
+	}
+	return replayer->buffer;
+}
+
+static Handle getReplayHandle(Replayer* replayer, FAT_int32_t descriptor) {
+	if(descriptor < 0 || descriptor >= replayer->total_descriptors || replayer->descriptors[descriptor] == -1)
+		return NULL;
+	return getHandleFAT(replayer->fat, replayer->descriptors[descriptor]);
+}
+
+static int mapDescriptor(Replayer* replayer, FAT_int32_t traced, int replayed) {
+	int i;
+	int* descriptors;
+	if(traced >= replayer->total_descriptors) {
+		descriptors = (int*)realloc(replayer->descriptors, (size_t)(traced + 1) * 2 * sizeof(int));
+		if(descriptors == NULL)
+			return -1;
+		for(i = replayer->total_descriptors; i < (traced + 1) * 2; ++i)
+			descriptors[i] = -1;
+		replayer->descriptors = descriptors;
+		replayer->total_descriptors = (traced + 1) * 2;
+	}
+	replayer->descriptors[traced] = replayed;
+	return 0;
+}
+
+static int ignoreMatch(const char* path, DirectoryEntryType file_type, void* user_data) {
+	(void)path;
+	(void)file_type;
+	(void)user_data;
+	return 0;
+}
+
+/*
+* Reads the operations of the batch from the records following it.
+* Returns -1 on error.
+*/
+static int replayBatch(Replayer* replayer, const TraceRecord* record, FAT_int64_t* result) {
+	int i;
+	int count = (int)record->argument;
+	int err = 0;
+	char* buffer;
+	BatchOperation* operations = (BatchOperation*)calloc((size_t)(count > 0 ? count : 1), sizeof(BatchOperation));
+	if(operations == NULL)
+		return -1;
+	for(i = 0; i < count && err == 0; ++i) {
+		if(readNextRecord(replayer) != 1 || replayer->next.operation != TRACE_BATCH_OPERATION ||
+		   replayer->next.name == NULL || (buffer = getBuffer(replayer, replayer->next.argument)) == NULL) {
+			err = -1;
+			break;
+		}
+		operations[i].type = (BatchOperationType)replayer->next.mode;
+		operations[i].size = (size_t)replayer->next.argument;
+		operations[i].offset = (FAT_uint64_t)replayer->next.argument2;
+		operations[i].filename = (char*)malloc(strlen(replayer->next.name) + 1);
+		if(operations[i].filename == NULL) {
+			err = -1;
+			break;
+		}
+		strcpy((char*)operations[i].filename, replayer->next.name);
+	}
+	/*
+	* The buffer could have moved while reading the sizes
+	*/
+	for(i = 0; i < count && err == 0; ++i)
+		operations[i].data = replayer->buffer;
+	if(err == 0) {
+		*result = submitBatchFAT(replayer->fat, operations, count);
+		for(i = 0; i < count; ++i)
+			replayer->bytes_written += operations[i].result == 0 ? operations[i].size : 0;
+	}
+	for(i = 0; i < count; ++i)
+		free((void*)operations[i].filename);
+	free(operations);
+	return err;
+}
+
+/*
+* Returns -1 if the record can't be replayed.
+*/
+static int replayRecord(Replayer* replayer, const TraceRecord* record) {
+	FAT_int64_t result = 0;
+	FAT_uint64_t start;
+	Handle handle = NULL;
+	IoVector vector;
+	DedupReport dedup_report;
+	ScrubReport scrub_report;
+	DirectoryStats directory_stats;
+	DirectoryElement* list;
+	if(record->handle != -1 && (handle = getReplayHandle(replayer, record->handle)) == NULL) {
+		++replayer->mismatches;
+		return 0;
+	}
+	if(record->operation == TRACE_WRITE || record->operation == TRACE_READ ||
+	   record->operation == TRACE_WRITEV || record->operation == TRACE_READV) {
+		vector.length = (size_t)record->argument;
+		vector.base = getBuffer(replayer, record->argument);
+		if(vector.base == NULL)
+			return -1;
+	}
+	start = getTraceTime();
+	switch(record->operation) {
+		case TRACE_OPEN:
+			result = openFileFAT(replayer->fat, record->name);
+			if(result != -1 && record->result != -1 && mapDescriptor(replayer, (FAT_int32_t)record->result, (int)result) == -1)
+				return -1;
+			break;
+		case TRACE_CLOSE:
+			result = closeFileFAT(replayer->fat, replayer->descriptors[record->handle]);
+			replayer->descriptors[record->handle] = -1;
+			break;
+		case TRACE_ERASE:
+			result = eraseFileFAT(replayer->fat, record->name);
+			break;
+		case TRACE_ERASE_AT:
+			result = eraseFileFATAt(handle);
+			break;
+		case TRACE_CLONE:
+			result = cloneFileFAT(replayer->fat, record->name, record->name2);
+			break;
+		case TRACE_DEDUP:
+			result = dedupFAT(replayer->fat, &dedup_report);
+			break;
+		case TRACE_COMPRESS:
+			result = compressFileFAT(replayer->fat, record->name);
+			break;
+		case TRACE_WRITE:
+			result = writeFAT64(handle, vector.base, vector.length);
+			replayer->bytes_written += result > 0 ? (FAT_uint64_t)result : 0;
+			break;
+		case TRACE_READ:
+			result = readFAT64(handle, vector.base, vector.length);
+			replayer->bytes_read += result > 0 ? (FAT_uint64_t)result : 0;
+			break;
+		case TRACE_WRITEV:
+			result = writevFAT(handle, &vector, 1);
+			replayer->bytes_written += result > 0 ? (FAT_uint64_t)result : 0;
+			break;
+		case TRACE_READV:
+			result = readvFAT(handle, &vector, 1);
+			replayer->bytes_read += result > 0 ? (FAT_uint64_t)result : 0;
+			break;
+		case TRACE_SEEK:
+			result = seekFAT64(handle, record->argument, (SeekWhence)record->mode);
+			break;
+		case TRACE_TRUNCATE:
+			result = truncateFAT64(handle, (FAT_uint64_t)record->argument);
+			break;
+		case TRACE_BATCH:
+			if(replayBatch(replayer, record, &result) == -1)
+				return -1;
+			break;
+		case TRACE_CREATE_DIR:
+			result = createDirFAT(replayer->fat, record->name);
+			break;
+		case TRACE_ERASE_DIR:
+			result = eraseDirFAT(replayer->fat, record->name);
+			break;
+		case TRACE_ERASE_TREE:
+			result = eraseTreeFAT(replayer->fat, record->name);
+			break;
+		case TRACE_RENAME:
+			result = renameFAT(replayer->fat, record->name, record->name2);
+			break;
+		case TRACE_MOVE:
+			result = moveFAT(replayer->fat, record->name, record->name2);
+			break;
+		case TRACE_CHANGE_DIR:
+			result = changeDirFAT(replayer->fat, record->name);
+			break;
+		case TRACE_LIST_DIR:
+			list = listDirFAT(replayer->fat);
+			result = list != NULL ? 0 : -1;
+			freeDirList(list);
+			break;
+		case TRACE_FIND:
+			result = findFAT(replayer->fat, record->name, (FindMode)record->mode, ignoreMatch, NULL);
+			break;
+		case TRACE_SCRUB:
+			result = scrubFAT(replayer->fat, record->mode, &scrub_report);
+			break;
+		case TRACE_STAT_DIR:
+			result = statDirFAT(replayer->fat, record->name, &directory_stats);
+			break;
+		case TRACE_SET_QUOTA:
+			result = setDirQuotaFAT(replayer->fat, record->name, (FAT_uint64_t)record->argument, (FAT_uint32_t)record->mode);
+			break;
+		case TRACE_SNAPSHOT:
+			/*
+			* The snapshot would overwrite the file recorded in the trace
+			*/
+			return 0;
+		default:
+			return -1;
+	}
+	if(addLatency(&replayer->latencies[record->operation], getTraceTime() - start) == -1)
+		return -1;
+	if(result != record->result && !(record->operation == TRACE_OPEN && result != -1 && record->result != -1))
+		++replayer->mismatches;
+	return 0;
+}
+
+static int replayNext(Replayer* replayer) {
+	TraceRecord record = replayer->next;
+	if(replayRecord(replayer, &record) == -1) {
+		fprintf(stderr, "failed to replay a record of %s: %s\n", replayer->trace_name, strerror(errno));
+		replayer->failed = 1;
+		return -1;
+	}
+	return readNextRecord(replayer);
+}
+
+static void* replayTrace(void* argument) {
+	Replayer* replayer = (Replayer*)argument;
+	while(replayer->has_next && replayNext(replayer) != -1)
+		;
+	return NULL;
+}
+
+/*
+* Replays the records of all the traces one at a time, in the order they were recorded.
+*/
+static void replayInOrder(Replayer* replayers, int count) {
+	int i;
+	Replayer* first;
+	for(;;) {
+		first = NULL;
+		for(i = 0; i < count; ++i) {
+			if(replayers[i].has_next && !replayers[i].failed && (first == NULL || replayers[i].next.start < first->next.start))
+				first = &replayers[i];
+		}
+		if(first == NULL)
+			break;
+		replayNext(first);
+	}
+}
+
+static void printReport(Replayer* replayers, int count, double seconds) {
+	int i;
+	int operation;
+	size_t j;
+	LatencyList* list;
+	FAT_uint64_t calls = 0;
+	FAT_uint64_t mismatches = 0;
+	FAT_uint64_t bytes_read = 0;
+	FAT_uint64_t bytes_written = 0;
+	LatencyList merged;
+	LatencyList all = { NULL, 0, 0 };
+	printf("%-12s %10s %10s %10s %10s %10s %10s\n", "operation", "calls", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+	for(operation = 1; operation < TRACE_OPERATIONS_END; ++operation) {
+		merged.values = NULL;
+		merged.count = merged.capacity = 0;
+		for(i = 0; i < count; ++i) {
+			list = &replayers[i].latencies[operation];
+			for(j = 0; j < list->count; ++j) {
+				addLatency(&merged, list->values[j]);
+				addLatency(&all, list->values[j]);
+			}
+		}
+		if(operation_names[operation] != NULL)
+			printLatencies(operation_names[operation], &merged);
+		calls += merged.count;
+		free(merged.values);
+	}
+	printLatencies("all", &all);
+	free(all.values);
+	for(i = 0; i < count; ++i) {
+		mismatches += replayers[i].mismatches;
+		bytes_read += replayers[i].bytes_read;
+		bytes_written += replayers[i].bytes_written;
+	}
+	printf("calls: %lu, seconds: %.3f, calls per second: %.0f\n", (unsigned long)calls, seconds, (double)calls / seconds);
+	printf("read: %.2f MiB (%.2f MiB/s), written: %.2f MiB (%.2f MiB/s)\n",
+		   (double)bytes_read / 1048576.0, (double)bytes_read / 1048576.0 / seconds,
+		   (double)bytes_written / 1048576.0, (double)bytes_written / 1048576.0 / seconds);
+	printf("calls with a different result than in the trace: %lu\n", (unsigned long)mismatches);
+}
+
+int main(int argc, char** argv) {
+	int i;
+	int operation;
+	int err = 0;
+	int concurrent = 0;
+	int count = 0;
+	FAT_uint64_t start;
+	Replayer* replayers;
+	pthread_t* threads = NULL;
+	FAT disk;
+	if(argc < 3) {
+		puts("the first argument must be the name of the disk to create, followed by the traces to replay on it, "
+			 "each trace is replayed on its own mount of the disk as the process that recorded it, "
+			 "pass --concurrent to replay each trace on its own thread instead of one record at a time in the recorded order");
+		return 1;
+	}
+	replayers = (Replayer*)calloc((size_t)argc, sizeof(Replayer));
+	if(replayers == NULL) {
+		perror("failed to allocate memory");
+		return 1;
+	}
+	disk = initSharedFAT(argv[1], 1);
+	if(disk == NULL) {
+		perror("failed to create the disk");
+		free(replayers);
+		return 1;
+	}
+	for(i = 2; i < argc; ++i) {
+		if(strcmp(argv[i], "--concurrent") == 0) {
+			concurrent = 1;
+			continue;
+		}
+		replayers[count].trace_name = argv[i];
+		replayers[count].trace = openTrace(argv[i]);
+		if(replayers[count].trace == NULL) {
+			fprintf(stderr, "failed to open the trace %s: %s\n", argv[i], strerror(errno));
+			err = 1;
+			goto cleanup;
+		}
+		/*
+		* Every trace gets its own mount of the disk, each one with its own working
+		* directory and file locks, as the process that recorded it had
+		*/
+		replayers[count].fat = count == 0 ? disk : initSharedFAT(argv[1], 0);
+		if(replayers[count].fat == NULL) {
+			perror("failed to open the disk");
+			closeTrace(replayers[count].trace);
+			err = 1;
+			goto cleanup;
+		}
+		++count;
+		readNextRecord(&replayers[count - 1]);
+	}
+	start = getTraceTime();
+	if(concurrent) {
+		threads = (pthread_t*)malloc((size_t)count * sizeof(pthread_t));
+		if(threads == NULL) {
+			perror("failed to allocate memory");
+			err = 1;
+			goto cleanup;
+		}
+		for(i = 0; i < count; ++i) {
+			if(pthread_create(&threads[i], NULL, replayTrace, &replayers[i]) != 0) {
+				perror("failed to start a replay thread");
+				err = 1;
+				break;
+			}
+		}
+		while(i-- > 0)
+			pthread_join(threads[i], NULL);
+		free(threads);
+	} else {
+		replayInOrder(replayers, count);
+	}
+	printReport(replayers, count, (double)(getTraceTime() - start) / 1e9);
+cleanup:
+	for(i = 0; i < count; ++i) {
+		if(replayers[i].failed)
+			err = 1;
+		closeTrace(replayers[i].trace);
+		terminateFAT(replayers[i].fat);
+		free(replayers[i].descriptors);
+		free(replayers[i].buffer);
+		for(operation = 0; operation < TRACE_OPERATIONS_END; ++operation)
+			free(replayers[i].latencies[operation].values);
+	}
+	if(count == 0)
+		terminateFAT(disk);
+	free(replayers);
+	return err;
+}
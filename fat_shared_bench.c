@@ -0,0 +1,125 @@
+#include "FAT.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define FILE_SIZE 8192
+#define WRITE_SIZE 512
+
+/*
+* Every worker rewrites parts of its own file and reads them back, and creates
+* and erases a temporary file every few operations, all in the same directory.
+*/
+static int runWorker(const char* diskname, int worker, int operations) {
+	int i;
+	int err = 0;
+	char name[32];
+	char temp_name[32];
+	char data[WRITE_SIZE];
+	char read_back[WRITE_SIZE];
+	Handle handle;
+	Handle temp;
+	FAT fat = initSharedFAT(diskname, 0);
+	if(fat == NULL) {
+		perror("failed to open the shared disk");
+		return 1;
+	}
+	sprintf(name, "worker %d", worker);
+	sprintf(temp_name, "temp %d", worker);
+	memset(data, 'a' + worker % 26, sizeof(data));
+	if((handle = createFileFAT(fat, name)) == NULL) {
+		perror("failed to create the worker file");
+		terminateFAT(fat);
+		return 1;
+	}
+	srand((unsigned)worker);
+	for(i = 0; i < operations && err == 0; ++i) {
+		seekFAT(handle, (rand() % (FILE_SIZE / WRITE_SIZE)) * WRITE_SIZE, FAT_SEEK_SET);
+		if(writeFAT(handle, data, sizeof(data)) != (int)sizeof(data))
+			err = 1;
+		seekFAT(handle, -WRITE_SIZE, FAT_SEEK_CUR);
+		if(readFAT(handle, read_back, sizeof(read_back)) != (int)sizeof(read_back) || memcmp(data, read_back, sizeof(data)) != 0)
+			err = 1;
+		if(i % 16 == 0) {
+			if((temp = createFileFAT(fat, temp_name)) == NULL || writeFAT(temp, data, sizeof(data)) != (int)sizeof(data))
+				err = 1;
+			if(temp != NULL)
+				freeHandle(temp);
+			if(eraseFileFAT(fat, temp_name) != 0)
+				err = 1;
+		}
+	}
+	if(err != 0)
+		printf("worker %d failed at operation %d: %s\n", worker, i, strerror(errno));
+	freeHandle(handle);
+	terminateFAT(fat);
+	return err;
+}
+
+static double getSeconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static int runBenchmark(const char* diskname, int workers, int operations) {
+	int i;
+	int status;
+	int err = 0;
+	double start;
+	double elapsed;
+	pid_t pid;
+	FAT fat = initSharedFAT(diskname, 1);
+	if(fat == NULL) {
+		perror("failed to create the shared disk");
+		return 1;
+	}
+	terminateFAT(fat);
+	/*
+	* Otherwise the output of the previous runs is printed again by the workers
+	*/
+	fflush(stdout);
+	start = getSeconds();
+	for(i = 0; i < workers; ++i) {
+		pid = fork();
+		if(pid == -1) {
+			perror("failed to start a worker");
+			return 1;
+		}
+		if(pid == 0)
+			exit(runWorker(diskname, i, operations));
+	}
+	for(i = 0; i < workers; ++i) {
+		if(wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			err = 1;
+	}
+	elapsed = getSeconds() - start;
+	printf("workers: %d, operations: %d, seconds: %.3f, operations per second: %.0f%s\n",
+		   workers, workers * operations, elapsed, (double)(workers * operations) / elapsed,
+		   err ? ", some workers failed" : "");
+	return err;
+}
+
+int main(int argc, char** argv) {
+	int err = 0;
+	int operations = 10000;
+	int max_workers = 8;
+	int workers;
+	if(argc < 2) {
+		puts("the first argument must be the name of the disk to create, "
+			 "the optional second and third the maximum number of worker processes and the operations done by each of them");
+		return 1;
+	}
+	if(argc > 2)
+		max_workers = atoi(argv[2]);
+	if(argc > 3)
+		operations = atoi(argv[3]);
+	for(workers = 1; workers <= max_workers && err == 0; workers *= 2)
+		err = runBenchmark(argv[1], workers, operations);
+	return err;
+}
@@ -0,0 +1,23 @@
+#include "FAT.h"
+#include <stdio.h>
+#include <unistd.h> /*STDOUT_FILENO*/
+
+int main(int argc, char** argv) {
+	int err;
+	FAT fat;
+	if(argc < 2) {
+		puts("the first argument must be the name of the disk to write to the standard output as a tar archive");
+		return 1;
+	}
+	fat = initFAT(argv[1], 0);
+	if(fat == NULL) {
+		perror("failed to open disk");
+		return 1;
+	}
+	err = exportTarFAT(fat, STDOUT_FILENO);
+	if(err == -1)
+		perror("failed to export the disk");
+	if(terminateFAT(fat) != 0)
+		perror("failed to close disk");
+	return err == -1 ? 1 : 0;
+}
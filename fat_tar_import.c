@@ -0,0 +1,33 @@
+#include "FAT.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h> /*STDIN_FILENO*/
+
+int main(int argc, char** argv) {
+	int i;
+	int imported;
+	int append = 0;
+	FAT fat;
+	if(argc < 2) {
+		puts("the first argument must be the name of the disk to create from the tar archive read from the standard input, "
+			 "pass --append to add the archive to an existing disk instead");
+		return 1;
+	}
+	for(i = 2; i < argc; ++i) {
+		if(strcmp(argv[i], "--append") == 0)
+			append = 1;
+	}
+	fat = initFAT(argv[1], !append);
+	if(fat == NULL) {
+		perror("failed to initialize FAT");
+		return 1;
+	}
+	imported = importTarFAT(fat, STDIN_FILENO);
+	if(imported == -1)
+		perror("failed to import the archive");
+	else
+		fprintf(stderr, "imported %d files and directories\n", imported);
+	if(terminateFAT(fat) != 0)
+		perror("failed to close disk");
+	return imported == -1 ? 1 : 0;
+}
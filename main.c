@@ -2,6 +2,11 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 static void printFolderContents(const DirectoryElement* contents) {
 	const DirectoryElement* cur_element;
@@ -19,6 +24,13 @@ static void printCurrentFolderContents(FAT fat) {
 	freeDirList(contents);
 }
 
+static int printFoundPath(const char* path, DirectoryEntryType file_type, void* user_data) {
+	(void)file_type;
+	(void)user_data;
+	printf("found: %s\n", path);
+	return 0;
+}
+
 static char *rand_string(char *str, size_t size) {
 	size_t n;
     const char charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJK";
@@ -54,6 +66,294 @@ static void createTooManyChildren(FAT fat, const char* dirname) {
 	printCurrentFolderContents(fat);
 }
 
+/*
+* Truncates a file sharing its tail with a clone while another handle still points
+* into that tail, the write through the stale handle must not reach the clone.
+*/
+static int checkCloneAfterTruncate(FAT fat) {
+	int i;
+	int err = -1;
+	char data[2048];
+	char read_char = 0;
+	Handle original = NULL;
+	Handle stale = NULL;
+	Handle clone = NULL;
+	for(i = 0; i < (int)sizeof(data); ++i)
+		data[i] = (char)('A' + i / 512);
+	if((original = createFileFAT(fat, "truncated")) == NULL ||
+	   writeFAT(original, data, sizeof(data)) != (int)sizeof(data) ||
+	   cloneFileFAT(fat, "truncated", "truncated clone") == -1)
+		goto cleanup;
+	seekFAT(original, 0, FAT_SEEK_SET);
+	if(writeFAT(original, "a", 1) != 1 || (stale = createFileFAT(fat, "truncated")) == NULL)
+		goto cleanup;
+	seekFAT(stale, 1536, FAT_SEEK_SET);
+	if(readFAT(stale, &read_char, 1) != 1 || truncateFAT(original, 100) == -1)
+		goto cleanup;
+	seekFAT(stale, 1536, FAT_SEEK_SET);
+	if(writeFAT(stale, "X", 1) != 1 || (clone = createFileFAT(fat, "truncated clone")) == NULL)
+		goto cleanup;
+	seekFAT(clone, 1536, FAT_SEEK_SET);
+	if(readFAT(clone, &read_char, 1) != 1)
+		goto cleanup;
+	printf("clone content after truncating the original: '%c', expected: 'D'\n", read_char);
+	if(read_char == 'D')
+		err = 0;
+cleanup:
+	if(original)
+		freeHandle(original);
+	if(stale)
+		freeHandle(stale);
+	if(clone)
+		freeHandle(clone);
+	return err;
+}
+
+/*
+* Returns the number of blocks in use, or -1 on error.
+*/
+static long countUsedBlocks(FAT fat) {
+	ScrubReport report;
+	if(scrubFAT(fat, 1, &report) == -1)
+		return -1;
+	return (long)report.checked_blocks + (long)report.unknown_blocks;
+}
+
+/*
+* Returns 0 if the file holds exactly *size* bytes matching *expected*.
+*/
+static int compareFileContent(FAT fat, const char* filename, const char* expected, int size) {
+	int err = -1;
+	static char read_back[20480];
+	Handle handle = createFileFAT(fat, filename);
+	if(handle == NULL)
+		return -1;
+	if(readFAT(handle, read_back, sizeof(read_back)) == size && memcmp(expected, read_back, (size_t)size) == 0)
+		err = 0;
+	freeHandle(handle);
+	return err;
+}
+
+/*
+* Compresses a file spanning several clusters, and writes in the middle of it so
+* that it goes back to being uncompressed, a clone taken while it was compressed
+* must keep the old content.
+*/
+static int checkCompressedRewrite(FAT fat) {
+	int i;
+	long used_blocks;
+	char data[12288];
+	Handle handle = NULL;
+	for(i = 0; i < (int)sizeof(data); ++i)
+		data[i] = (char)('a' + (i / 7) % 5 + (i % 1000 == 0));
+	if((handle = createFileFAT(fat, "compressed")) == NULL || writeFAT(handle, data, sizeof(data)) != (int)sizeof(data))
+		goto error;
+	freeHandle(handle);
+	handle = NULL;
+	used_blocks = countUsedBlocks(fat);
+	if(used_blocks == -1 || compressFileFAT(fat, "compressed") == -1 || cloneFileFAT(fat, "compressed", "compressed clone") == -1)
+		goto error;
+	printf("blocks freed by compressing the file: %ld\n", used_blocks - countUsedBlocks(fat));
+	if(countUsedBlocks(fat) >= used_blocks || compareFileContent(fat, "compressed", data, sizeof(data)) == -1)
+		goto error;
+	if((handle = createFileFAT(fat, "compressed")) == NULL || seekFAT(handle, 5000, FAT_SEEK_SET) == -1 ||
+	   writeFAT(handle, "rewritten", 9) != 9)
+		goto error;
+	freeHandle(handle);
+	handle = NULL;
+	if(compareFileContent(fat, "compressed clone", data, sizeof(data)) == -1)
+		goto error;
+	memcpy(data + 5000, "rewritten", 9);
+	if(compareFileContent(fat, "compressed", data, sizeof(data)) == -1)
+		goto error;
+	return 0;
+error:
+	if(handle)
+		freeHandle(handle);
+	return -1;
+}
+
+/*
+* Two files written separately with the same content must end up sharing their
+* blocks, and a write to one of them must not show in the other.
+*/
+static int checkDedup(FAT fat) {
+	int i;
+	char data[2048];
+	DedupReport report;
+	Handle handle = NULL;
+	for(i = 0; i < (int)sizeof(data); ++i)
+		data[i] = (char)(i * 31);
+	for(i = 0; i < 2; ++i) {
+		if((handle = createFileFAT(fat, i == 0 ? "duplicate 1" : "duplicate 2")) == NULL ||
+		   writeFAT(handle, data, sizeof(data)) != (int)sizeof(data))
+			goto error;
+		freeHandle(handle);
+		handle = NULL;
+	}
+	if(dedupFAT(fat, &report) == -1)
+		goto error;
+	printf("blocks shared by deduplicating: %u\n", report.shared_blocks);
+	if(report.shared_blocks < 4 || (handle = createFileFAT(fat, "duplicate 1")) == NULL || writeFAT(handle, "changed", 7) != 7)
+		goto error;
+	freeHandle(handle);
+	handle = NULL;
+	if(compareFileContent(fat, "duplicate 2", data, sizeof(data)) == -1)
+		goto error;
+	memcpy(data, "changed", 7);
+	if(compareFileContent(fat, "duplicate 1", data, sizeof(data)) == -1)
+		goto error;
+	return 0;
+error:
+	if(handle)
+		freeHandle(handle);
+	return -1;
+}
+
+#define LONG_TAR_DIR "a directory with a name long enough to not fit in a tar header"
+#define LONG_TAR_FILE "and a file inside of it, together they are well over a hundred characters"
+
+/*
+* Returns 0 if a file created with *name* and *content* could be written.
+*/
+static int writeTestFile(FAT fat, const char* name, const char* content, int size) {
+	int written;
+	Handle handle = createFileFAT(fat, name);
+	if(handle == NULL)
+		return -1;
+	written = writeFAT(handle, content, size);
+	freeHandle(handle);
+	return written == size ? 0 : -1;
+}
+
+/*
+* A pax header whose only record claims to be longer than the header itself.
+*/
+static int writeMalformedPaxArchive(int descriptor) {
+	int i;
+	unsigned long checksum = 0;
+	static char archive[2048];
+	const char record[] = "20 path=ab\n";
+	memset(archive, 0, sizeof(archive));
+	strcpy(archive, "PaxHeaders/malformed");
+	strcpy(archive + 100, "0000644");
+	sprintf(archive + 124, "%011o", (unsigned)(sizeof(record) - 1));
+	archive[156] = 'x';
+	memcpy(archive + 257, "ustar", 6);
+	memcpy(archive + 263, "00", 2);
+	memset(archive + 148, ' ', 8);
+	for(i = 0; i < 512; ++i)
+		checksum += (unsigned char)archive[i];
+	sprintf(archive + 148, "%06lo", checksum);
+	memcpy(archive + 512, record, sizeof(record) - 1);
+	return write(descriptor, archive, sizeof(archive)) == (int)sizeof(archive) ? 0 : -1;
+}
+
+/*
+* Exports nested directories, a path too long for the name field of a tar header,
+* a sparse file and a file spanning many blocks, imports them into a new disk at
+* *diskname* and compares the files, then imports a malformed archive.
+*/
+static int checkTarRoundTrip(FAT fat, const char* diskname) {
+	int i;
+	int err = -1;
+	static char big[20480];
+	static char sparse[9003];
+	FILE* archive = NULL;
+	FILE* malformed = NULL;
+	FAT copy = NULL;
+	Handle handle;
+	for(i = 0; i < (int)sizeof(big); ++i)
+		big[i] = (char)(i * 7 + i / 512);
+	memset(sparse, 0, sizeof(sparse));
+	memcpy(sparse, "start", 5);
+	memcpy(sparse + 9000, "end", 3);
+	if(createDirFAT(fat, "tar source") == -1 || changeDirFAT(fat, "tar source") == -1)
+		return -1;
+	if(writeTestFile(fat, "big", big, sizeof(big)) == -1 || (handle = createFileFAT(fat, "sparse")) == NULL)
+		goto cleanup;
+	i = writeFAT(handle, sparse, 5) == 5 && seekFAT(handle, 9000, FAT_SEEK_SET) == 0 && writeFAT(handle, sparse + 9000, 3) == 3;
+	freeHandle(handle);
+	if(!i || createDirFAT(fat, LONG_TAR_DIR) == -1 || changeDirFAT(fat, LONG_TAR_DIR) == -1 ||
+	   writeTestFile(fat, LONG_TAR_FILE, big, 1000) == -1 || changeDirFAT(fat, "..") == -1)
+		goto cleanup;
+	if((archive = tmpfile()) == NULL || exportTarFAT(fat, fileno(archive)) == -1 || lseek(fileno(archive), 0, SEEK_SET) == -1)
+		goto cleanup;
+	if((copy = initFAT(diskname, 1)) == NULL)
+		goto cleanup;
+	i = importTarFAT(copy, fileno(archive));
+	printf("entries imported from the exported archive: %d, expected: 4\n", i);
+	if(i != 4 || compareFileContent(copy, "big", big, sizeof(big)) == -1 ||
+	   compareFileContent(copy, "sparse", sparse, sizeof(sparse)) == -1 ||
+	   changeDirFAT(copy, LONG_TAR_DIR) == -1 || compareFileContent(copy, LONG_TAR_FILE, big, 1000) == -1)
+		goto cleanup;
+	if((malformed = tmpfile()) == NULL || writeMalformedPaxArchive(fileno(malformed)) == -1 ||
+	   lseek(fileno(malformed), 0, SEEK_SET) == -1)
+		goto cleanup;
+	if(importTarFAT(copy, fileno(malformed)) == -1 && errno == EINVAL)
+		err = 0;
+cleanup:
+	changeDirFAT(fat, "..");
+	if(copy) {
+		terminateFAT(copy);
+		remove(diskname);
+	}
+	if(archive)
+		fclose(archive);
+	if(malformed)
+		fclose(malformed);
+	return err;
+}
+
+/*
+* Overwrites a block with lazy checksums and leaves without terminateFAT, as a
+* crashed process would, the data must still read back with every block verified.
+*/
+static int checkLazyChecksumsAfterExit(const char* diskname) {
+	int status;
+	int err = -1;
+	char data[1024];
+	char read_back[1024];
+	FAT fat;
+	Handle handle;
+	ScrubReport report;
+	FlushPolicy policy;
+	pid_t pid = fork();
+	if(pid == -1)
+		return -1;
+	if(pid == 0) {
+		policy.max_dirty_blocks = 1;
+		policy.max_dirty_age_ms = 1;
+		memset(data, 'a', sizeof(data));
+		if((fat = initFAT(diskname, 1)) == NULL || startFlusherFAT(fat, &policy) == -1)
+			_exit(1);
+		setChecksumModeFAT(fat, FAT_CHECKSUM_LAZY);
+		/*
+		* The scrub stores the checksums of the first version of the blocks
+		*/
+		if((handle = createFileFAT(fat, "lazy")) == NULL || writeFAT(handle, data, sizeof(data)) != (int)sizeof(data) ||
+		   scrubFAT(fat, 1, &report) == -1)
+			_exit(1);
+		memset(data, 'b', sizeof(data));
+		seekFAT(handle, 0, FAT_SEEK_SET);
+		_exit(writeFAT(handle, data, sizeof(data)) != (int)sizeof(data));
+	}
+	if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1;
+	if((fat = initFAT(diskname, 0)) == NULL)
+		return -1;
+	setChecksumModeFAT(fat, FAT_CHECKSUM_ALWAYS);
+	memset(data, 'b', sizeof(data));
+	if((handle = createFileFAT(fat, "lazy")) != NULL) {
+		if(readFAT(handle, read_back, sizeof(read_back)) == (int)sizeof(read_back) && memcmp(data, read_back, sizeof(data)) == 0)
+			err = 0;
+		freeHandle(handle);
+	}
+	terminateFAT(fat);
+	remove(diskname);
+	return err;
+}
+
 int main(int argc, char** argv) {
 	int err;
 	int return_code = 0;
@@ -64,17 +364,40 @@ int main(int argc, char** argv) {
 	Handle handle2;
 	int written;
 	int read;
+	int descriptor;
+	IoVector vectors[2];
+	FlushPolicy policy;
+	DirectoryStats stats;
+	BatchOperation batch[2];
 	FAT fat;
+	char* other_disk;
 	if(argc < 2) {
 		puts("the filename paramter for the disk is required");
 		return 1;
 	}
+	/*
+	* The checks that need a disk of their own use this one
+	*/
+	other_disk = (char*)malloc(strlen(argv[1]) + sizeof(".other"));
+	if(other_disk == NULL) {
+		perror("failed to allocate memory");
+		return 1;
+	}
+	sprintf(other_disk, "%s.other", argv[1]);
 	fat = initFAT(argv[1], 1);
 	if(fat == NULL) {
 		perror("failed to initialize FAT");
+		free(other_disk);
 		return 1;
 	}
-	
+
+	policy.max_dirty_blocks = 4;
+	policy.max_dirty_age_ms = 10;
+	if(startFlusherFAT(fat, &policy) == -1) {
+		return_code = 1;
+		puts("failed to start the flusher");
+	}
+
 	if((handle = createFileFAT(fat, "aaa")) == NULL) {
 		return_code = 1;
 		puts("failed to create file");
@@ -142,6 +465,84 @@ int main(int argc, char** argv) {
 	read_string[read] = 0;
 	printf("total read after seeking with end: %d, to read were: %d, read content: \"%s\"\n", read, (int)sizeof(read_string), read_string);
 
+	if(cloneFileFAT(fat, "aaa", "aaa clone") == -1) {
+		return_code = 1;
+		puts("failed to clone file");
+		goto cleanup;
+	}
+
+	if((handle2 = createFileFAT(fat, "aaa clone")) == NULL) {
+		return_code = 1;
+		puts("failed to open cloned file");
+		goto cleanup;
+	}
+
+	written = writeFAT(handle2, b, 7);
+	printf("total written to the clone: %d, to write were: %d\n", written, 7);
+
+	seekFAT(handle2, 0, FAT_SEEK_SET);
+	read = readFAT(handle2, read_string, (int)sizeof(read_string));
+	read_string[read] = 0;
+	printf("total read from the clone: %d, to read were: %d, read content: \"%s\"\n", read, (int)sizeof(read_string), read_string);
+
+	freeHandle(handle2);
+	handle2 = NULL;
+
+	seekFAT(handle, 0, FAT_SEEK_SET);
+	read = readFAT(handle, read_string, (int)sizeof(read_string));
+	read_string[read] = 0;
+	printf("total read from the original after writing the clone: %d, to read were: %d, read content: \"%s\"\n", read, (int)sizeof(read_string), read_string);
+
+	if((descriptor = openFileFAT(fat, "bbb")) == -1) {
+		return_code = 1;
+		puts("failed to open file descriptor");
+		goto cleanup;
+	}
+
+	read = readFAT(getHandleFAT(fat, descriptor), read_string, (int)sizeof(read_string));
+	read_string[read] = 0;
+	printf("total read from descriptor %d: %d, read content: \"%s\"\n", descriptor, read, read_string);
+	closeFileFAT(fat, descriptor);
+
+	if(truncateFAT(handle, 3) == -1) {
+		return_code = 1;
+		puts("failed to truncate file");
+		goto cleanup;
+	}
+
+	seekFAT(handle, 0, FAT_SEEK_SET);
+	read = readFAT(handle, read_string, (int)sizeof(read_string));
+	read_string[read] = 0;
+	printf("total read after truncating the file to 3 bytes: %d, read content: \"%s\"\n", read, read_string);
+
+	vectors[0].base = b;
+	vectors[0].length = 8;
+	vectors[1].base = a;
+	vectors[1].length = 4;
+	written = (int)writevFAT(handle, vectors, 2);
+	printf("total written with 2 buffers: %d, to write were: %d\n", written, 12);
+
+	batch[0].type = FAT_BATCH_CREATE;
+	batch[0].filename = "batched";
+	batch[0].data = a;
+	batch[0].size = sizeof(a);
+	batch[0].offset = 0;
+	batch[1].type = FAT_BATCH_ERASE;
+	batch[1].filename = "bbb";
+	batch[1].data = NULL;
+	batch[1].size = 0;
+	batch[1].offset = 0;
+	if(submitBatchFAT(fat, batch, 2) != 0) {
+		return_code = 1;
+		puts("failed to run the batch");
+		goto cleanup;
+	}
+
+	seekFAT(handle, 0, FAT_SEEK_SET);
+	read = readFAT(handle, read_string, (int)sizeof(read_string));
+	read_string[read] = 0;
+	printf("total read after the vectored write: %d, read content: \"%s\"\n", read, read_string);
+
 	if(createDirFAT(fat, "this is a folder") == -1) {
 		return_code = 1;
 		puts("failed to create folder");
@@ -168,7 +569,70 @@ int main(int argc, char** argv) {
 	handle = NULL;
 
 	printCurrentFolderContents(fat);
+
+	if(moveFAT(fat, "aaa", "/") == -1 || changeDirFAT(fat, "/") == -1 || renameFAT(fat, "aaa", "moved folder") == -1) {
+		return_code = 1;
+		puts("failed to move folder");
+		goto cleanup;
+	}
+
+	if(renameFAT(fat, "moved folder", "a/b") != -1 || errno != EINVAL || renameFAT(fat, "moved folder", "..") != -1 || errno != EINVAL) {
+		return_code = 1;
+		puts("renaming to an invalid name didn't fail");
+		goto cleanup;
+	}
+
+	if(eraseTreeFAT(fat, "this is a folder") == -1) {
+		return_code = 1;
+		puts("failed to delete folder tree");
+		goto cleanup;
+	}
+
+	printCurrentFolderContents(fat);
+
+	if(findFAT(fat, "aaa*", FAT_FIND_GLOB, printFoundPath, NULL) == -1) {
+		return_code = 1;
+		puts("failed to search the disk");
+		goto cleanup;
+	}
 	
+	if(statDirFAT(fat, "/", &stats) == -1) {
+		return_code = 1;
+		puts("failed to read the totals of the root");
+		goto cleanup;
+	}
+	printf("the disk holds %lu bytes in %lu files and directories\n", (unsigned long)stats.size, (unsigned long)stats.total_entries);
+
+	if(checkCloneAfterTruncate(fat) == -1) {
+		return_code = 1;
+		puts("truncating a file changed its clone");
+		goto cleanup;
+	}
+
+	if(checkCompressedRewrite(fat) == -1) {
+		return_code = 1;
+		puts("a compressed file didn't read back its content");
+		goto cleanup;
+	}
+
+	if(checkDedup(fat) == -1) {
+		return_code = 1;
+		puts("deduplicated files didn't read back their content");
+		goto cleanup;
+	}
+
+	if(checkTarRoundTrip(fat, other_disk) == -1) {
+		return_code = 1;
+		puts("a tar archive didn't import back as it was exported");
+		goto cleanup;
+	}
+
+	if(checkLazyChecksumsAfterExit(other_disk) == -1) {
+		return_code = 1;
+		puts("a disk left without terminating it failed its checksums");
+		goto cleanup;
+	}
+
 	createTooManyChildren(fat, "/");
 	
 cleanup:
@@ -177,6 +641,7 @@ cleanup:
 	if(handle2)
 		freeHandle(handle2);
 	err = terminateFAT(fat);
+	free(other_disk);
 	assert((err == 0) && "failed to free the resources");
 	return return_code;
 }
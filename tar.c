@@ -0,0 +1,644 @@
+#include "FAT.h"
+#include <stddef.h> /*size_t, NULL*/
+#include <stdlib.h> /*malloc, free*/
+#include <string.h> /*memcpy, memset, memcmp, strlen*/
+#include <unistd.h> /*read, write*/
+#include <errno.h> /*errno*/
+
+#define TAR_BLOCK_SIZE 512
+/*
+* Size of the buffer used to move the file contents, the only big allocation
+* done by the import and the export whatever the size of the archive.
+*/
+#define TAR_BUFFER_SIZE (128 * TAR_BLOCK_SIZE)
+/*
+* Longest path accepted from GNU long name records and pax headers.
+*/
+#define TAR_MAX_PATH 4096
+
+#define TAR_TYPE_FILE '0'
+#define TAR_TYPE_OLD_FILE '\0'
+#define TAR_TYPE_CONTIGUOUS_FILE '7'
+#define TAR_TYPE_DIRECTORY '5'
+#define TAR_TYPE_GNU_LONG_NAME 'L'
+#define TAR_TYPE_PAX_HEADER 'x'
+
+/*
+* Largest size accepted from a pax header, so that it fits in a FAT_int64_t.
+*/
+#define MAX_PAX_SIZE ((FAT_uint64_t)(~(FAT_uint64_t)0 >> 1))
+
+#define roundToBlock(size) (((size) + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE)
+
+typedef struct TarHeader {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char padding[12];
+} TarHeader;
+
+typedef struct TarArchive {
+	FAT fat;
+	int descriptor;
+	char* buffer;
+	/*
+	* Import: directories entered from the one the import started from.
+	* Export: path of the directory being exported, ending with a /.
+	*/
+	char path[TAR_MAX_PATH + 1];
+	size_t path_length;
+	/*
+	* Path set by a GNU long name record or a pax header for the next entry.
+	*/
+	char long_name[TAR_MAX_PATH + 1];
+	int has_long_name;
+	/*
+	* Size set by a pax header for the next entry, -1 if none.
+	*/
+	FAT_int64_t pax_size;
+} TarArchive;
+
+/*
+* Returns the number of read bytes, less than size only at the end of the stream.
+* Returns -1 on error.
+*/
+static FAT_int64_t readFully(int descriptor, void* out, size_t size) {
+	ssize_t nread;
+	size_t total = 0;
+	while(total < size) {
+		nread = read(descriptor, (char*)out + total, size - total);
+		if(nread == 0)
+			break;
+		if(nread < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += (size_t)nread;
+	}
+	return (FAT_int64_t)total;
+}
+
+static int writeFully(int descriptor, const void* in, size_t size) {
+	ssize_t written;
+	size_t total = 0;
+	while(total < size) {
+		written = write(descriptor, (const char*)in + total, size - total);
+		if(written < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += (size_t)written;
+	}
+	return 0;
+}
+
+/*
+* Reads exactly size bytes, a shorter stream is a truncated archive.
+*/
+static int readArchive(TarArchive* archive, void* out, size_t size) {
+	FAT_int64_t nread = readFully(archive->descriptor, out, size);
+	if(nread == -1)
+		return -1;
+	if((size_t)nread != size) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+static int skipArchiveData(TarArchive* archive, FAT_uint64_t size) {
+	size_t chunk;
+	size = roundToBlock(size);
+	while(size > 0) {
+		chunk = size < TAR_BUFFER_SIZE ? (size_t)size : TAR_BUFFER_SIZE;
+		if(readArchive(archive, archive->buffer, chunk) == -1)
+			return -1;
+		size -= chunk;
+	}
+	return 0;
+}
+
+/*
+* Numbers are octal strings, or big endian binary numbers marked by the high bit
+* of the first byte (GNU extension for sizes of 8 GiB and more).
+*/
+static FAT_uint64_t parseNumber(const char* field, size_t length) {
+	size_t i;
+	FAT_uint64_t value = 0;
+	if((unsigned char)field[0] & 0x80) {
+		value = (unsigned char)field[0] & 0x7f;
+		for(i = 1; i < length; ++i)
+			value = (value << 8) | (unsigned char)field[i];
+		return value;
+	}
+	for(i = 0; i < length && (field[i] == ' ' || field[i] == '0'); ++i)
+		;
+	for(; i < length && field[i] >= '0' && field[i] <= '7'; ++i)
+		value = value * 8 + (FAT_uint64_t)(field[i] - '0');
+	return value;
+}
+
+static void formatNumber(char* field, size_t length, FAT_uint64_t value) {
+	size_t i;
+	/*
+	* length - 1 octal digits and a terminator, binary if it doesn't fit
+	*/
+	if(length * 3 - 3 < 64 && (value >> (length * 3 - 3)) != 0) {
+		for(i = length; i-- > 1;) {
+			field[i] = (char)(value & 0xff);
+			value >>= 8;
+		}
+		field[0] = (char)0x80;
+		return;
+	}
+	field[length - 1] = '\0';
+	for(i = length - 1; i-- > 0;) {
+		field[i] = (char)('0' + (value & 7));
+		value >>= 3;
+	}
+}
+
+static unsigned long computeHeaderChecksum(const TarHeader* header) {
+	size_t i;
+	unsigned long checksum = 0;
+	const unsigned char* bytes = (const unsigned char*)header;
+	for(i = 0; i < sizeof(TarHeader); ++i) {
+		if(i >= offsetof(TarHeader, checksum) && i < offsetof(TarHeader, checksum) + sizeof(header->checksum))
+			checksum += ' ';
+		else
+			checksum += bytes[i];
+	}
+	return checksum;
+}
+
+static size_t getFieldLength(const char* field, size_t length) {
+	const char* end = (const char*)memchr(field, '\0', length);
+	return end == NULL ? length : (size_t)(end - field);
+}
+
+/*
+* Parses the "length key=value\n" records of a pax header, only path and size are used.
+* Returns -1 and sets errno to EINVAL if a record is malformed.
+*/
+static int parsePaxHeader(TarArchive* archive, const char* data, size_t size) {
+	size_t record_length;
+	size_t key_length;
+	const char* record;
+	const char* value;
+	const char* end;
+	FAT_uint64_t pax_size;
+	while(size > 0) {
+		record_length = 0;
+		for(record = data; record < data + size && *record >= '0' && *record <= '9' && record_length <= size; ++record)
+			record_length = record_length * 10 + (size_t)(*record - '0');
+		if(record_length == 0 || record_length > size || record == data + size || *record != ' ')
+			goto error;
+		++record;
+		/*
+		* The record ends with a newline that isn't part of the value
+		*/
+		end = data + record_length - 1;
+		if(record >= end || *end != '\n')
+			goto error;
+		value = (const char*)memchr(record, '=', (size_t)(end - record));
+		if(value == NULL)
+			goto error;
+		key_length = (size_t)(value - record);
+		++value;
+		if(key_length == 4 && memcmp(record, "path", 4) == 0 && (size_t)(end - value) <= TAR_MAX_PATH) {
+			memcpy(archive->long_name, value, (size_t)(end - value));
+			archive->long_name[end - value] = '\0';
+			archive->has_long_name = 1;
+		} else if(key_length == 4 && memcmp(record, "size", 4) == 0) {
+			pax_size = 0;
+			for(; value < end && *value >= '0' && *value <= '9'; ++value) {
+				/*
+				* Sizes that don't fit in a FAT_int64_t can't be stored anyway
+				*/
+				if(pax_size > (MAX_PAX_SIZE - (FAT_uint64_t)(*value - '0')) / 10)
+					goto error;
+				pax_size = pax_size * 10 + (FAT_uint64_t)(*value - '0');
+			}
+			archive->pax_size = (FAT_int64_t)pax_size;
+		}
+		data += record_length;
+		size -= record_length;
+	}
+	return 0;
+error:
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+* Removes the leading /, the empty and . components and the trailing /.
+* Returns -1 if the path goes up with .., such entries aren't imported.
+*/
+static int normalizePath(char* path) {
+	char* in = path;
+	char* out = path;
+	size_t length;
+	while(*in != '\0') {
+		while(*in == '/')
+			++in;
+		length = strcspn(in, "/");
+		if(length == 2 && in[0] == '.' && in[1] == '.')
+			return -1;
+		if(length > 0 && !(length == 1 && in[0] == '.')) {
+			if(out != path)
+				*out++ = '/';
+			memmove(out, in, length);
+			out += length;
+		}
+		in += length;
+	}
+	*out = '\0';
+	return 0;
+}
+
+/*
+* Moves from the directory of the previous entry to the one of the passed path,
+* only going up and down through the components that differ, and creating the
+* missing directories.
+*/
+static int enterDirectory(TarArchive* archive, const char* path, size_t length) {
+	size_t common = 0;
+	size_t i;
+	size_t end;
+	char name[256];
+	/*
+	* Longest leading part of both paths made of whole components
+	*/
+	for(i = 0; i <= length && i <= archive->path_length; ++i) {
+		if((i == length || path[i] == '/') && (i == archive->path_length || archive->path[i] == '/'))
+			common = i;
+		if(i == length || i == archive->path_length || path[i] != archive->path[i])
+			break;
+	}
+	for(i = common; i < archive->path_length; ++i) {
+		if((i == 0 || archive->path[i] == '/') && changeDirFAT(archive->fat, "..") == -1)
+			return -1;
+	}
+	archive->path_length = common;
+	for(i = common; i < length; i = end) {
+		if(path[i] == '/')
+			++i;
+		for(end = i; end < length && path[end] != '/'; ++end)
+			;
+		if(end - i >= sizeof(name)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memcpy(name, path + i, end - i);
+		name[end - i] = '\0';
+		if(createDirFAT(archive->fat, name) == -1 || changeDirFAT(archive->fat, name) == -1)
+			return -1;
+		memcpy(archive->path + archive->path_length, path + archive->path_length, end - archive->path_length);
+		archive->path_length = end;
+	}
+	return 0;
+}
+
+static int isZeroBlock(const char* data) {
+	size_t i;
+	for(i = 0; i < TAR_BLOCK_SIZE; ++i) {
+		if(data[i] != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+* Blocks of zeros are skipped instead of written, leaving holes in the file.
+*/
+static int importFileData(TarArchive* archive, Handle handle, FAT_uint64_t size) {
+	size_t chunk;
+	size_t offset;
+	size_t run;
+	size_t data_size;
+	int zeros;
+	FAT_uint64_t remaining = roundToBlock(size);
+	FAT_uint64_t file_remaining = size;
+	while(remaining > 0) {
+		chunk = remaining < TAR_BUFFER_SIZE ? (size_t)remaining : TAR_BUFFER_SIZE;
+		if(readArchive(archive, archive->buffer, chunk) == -1)
+			return -1;
+		remaining -= chunk;
+		data_size = file_remaining < chunk ? (size_t)file_remaining : chunk;
+		file_remaining -= data_size;
+		for(offset = 0; offset < data_size; offset += run) {
+			zeros = isZeroBlock(archive->buffer + offset);
+			for(run = TAR_BLOCK_SIZE; offset + run < data_size && isZeroBlock(archive->buffer + offset + run) == zeros; run += TAR_BLOCK_SIZE)
+				;
+			if(offset + run > data_size)
+				run = data_size - offset;
+			if(zeros) {
+				if(seekFAT64(handle, (FAT_int64_t)run, FAT_SEEK_CUR) == -1)
+					return -1;
+			} else if(writeFAT64(handle, archive->buffer + offset, run) != (FAT_int64_t)run) {
+				if(errno == 0)
+					errno = ENOSPC;
+				return -1;
+			}
+		}
+	}
+	/*
+	* Sets the size if the file ends with zeros that were skipped
+	*/
+	return truncateFAT64(handle, size);
+}
+
+static int importFile(TarArchive* archive, const char* path, FAT_uint64_t size) {
+	int err;
+	int file_descriptor;
+	Handle handle;
+	const char* name = strrchr(path, '/');
+	if(name == NULL) {
+		name = path;
+		err = enterDirectory(archive, path, 0);
+	} else {
+		err = enterDirectory(archive, path, (size_t)(name - path));
+		++name;
+	}
+	if(err == -1)
+		return -1;
+	file_descriptor = openFileFAT(archive->fat, name);
+	if(file_descriptor == -1)
+		return -1;
+	handle = getHandleFAT(archive->fat, file_descriptor);
+	errno = 0;
+	err = truncateFAT64(handle, 0);
+	if(err == 0)
+		err = importFileData(archive, handle, size);
+	closeFileFAT(archive->fat, file_descriptor);
+	return err;
+}
+
+/*
+* Returns 1 if an entry was imported, 0 if the entry was skipped or only
+* describes the following one, 2 at the end of the archive.
+* Returns -1 on error.
+*/
+static int importEntry(TarArchive* archive) {
+	TarHeader header;
+	FAT_uint64_t size;
+	FAT_int64_t nread;
+	size_t length;
+	char path[TAR_MAX_PATH + 1];
+	int imported = 0;
+	nread = readFully(archive->descriptor, &header, sizeof(header));
+	if(nread == -1)
+		return -1;
+	/*
+	* A stream ending without the two zero blocks is accepted as well
+	*/
+	if(nread == 0 || isZeroBlock((const char*)&header))
+		return 2;
+	if((size_t)nread != sizeof(header) ||
+	   parseNumber(header.checksum, sizeof(header.checksum)) != computeHeaderChecksum(&header)) {
+		errno = EINVAL;
+		return -1;
+	}
+	size = parseNumber(header.size, sizeof(header.size));
+	switch(header.typeflag) {
+		case TAR_TYPE_GNU_LONG_NAME:
+			if(size > TAR_MAX_PATH) {
+				errno = ENAMETOOLONG;
+				return -1;
+			}
+			if(readArchive(archive, archive->buffer, roundToBlock((size_t)size)) == -1)
+				return -1;
+			memcpy(archive->long_name, archive->buffer, (size_t)size);
+			archive->long_name[size] = '\0';
+			archive->has_long_name = 1;
+			return 0;
+		case TAR_TYPE_PAX_HEADER:
+			if(size > TAR_BUFFER_SIZE)
+				return skipArchiveData(archive, size) == -1 ? -1 : 0;
+			if(readArchive(archive, archive->buffer, roundToBlock((size_t)size)) == -1)
+				return -1;
+			return parsePaxHeader(archive, archive->buffer, (size_t)size);
+		default:
+			break;
+	}
+	if(archive->has_long_name) {
+		memcpy(path, archive->long_name, strlen(archive->long_name) + 1);
+	} else {
+		length = 0;
+		if(memcmp(header.magic, "ustar", 5) == 0 && header.prefix[0] != '\0') {
+			length = getFieldLength(header.prefix, sizeof(header.prefix));
+			memcpy(path, header.prefix, length);
+			path[length++] = '/';
+		}
+		memcpy(path + length, header.name, getFieldLength(header.name, sizeof(header.name)));
+		path[length + getFieldLength(header.name, sizeof(header.name))] = '\0';
+	}
+	if(archive->pax_size != -1)
+		size = (FAT_uint64_t)archive->pax_size;
+	archive->has_long_name = 0;
+	archive->pax_size = -1;
+	if(normalizePath(path) == -1 || path[0] == '\0')
+		return skipArchiveData(archive, size) == -1 ? -1 : 0;
+	switch(header.typeflag) {
+		case TAR_TYPE_DIRECTORY:
+			if(enterDirectory(archive, path, strlen(path)) == -1 || skipArchiveData(archive, size) == -1)
+				return -1;
+			imported = 1;
+			break;
+		case TAR_TYPE_FILE:
+		case TAR_TYPE_OLD_FILE:
+		case TAR_TYPE_CONTIGUOUS_FILE:
+			if(importFile(archive, path, size) == -1)
+				return -1;
+			imported = 1;
+			break;
+		default:
+			/*
+			* Links, devices and the other special files have no equivalent in the disk
+			*/
+			if(skipArchiveData(archive, size) == -1)
+				return -1;
+			break;
+	}
+	return imported;
+}
+
+static TarArchive* createArchive(FAT fat, int descriptor) {
+	TarArchive* archive = (TarArchive*)malloc(sizeof(TarArchive));
+	if(archive == NULL)
+		return NULL;
+	archive->buffer = (char*)malloc(TAR_BUFFER_SIZE);
+	if(archive->buffer == NULL) {
+		free(archive);
+		return NULL;
+	}
+	archive->fat = fat;
+	archive->descriptor = descriptor;
+	archive->path_length = 0;
+	archive->has_long_name = 0;
+	archive->pax_size = -1;
+	return archive;
+}
+
+static void freeArchive(TarArchive* archive) {
+	free(archive->buffer);
+	free(archive);
+}
+
+int importTarFAT(FAT fat, int descriptor) {
+	int prev_errno;
+	int result;
+	int imported = 0;
+	TarArchive* archive = createArchive(fat, descriptor);
+	if(archive == NULL)
+		return -1;
+	while((result = importEntry(archive)) == 0 || result == 1)
+		imported += result;
+	prev_errno = errno;
+	/*
+	* Goes back to the directory the import started from
+	*/
+	enterDirectory(archive, "", 0);
+	freeArchive(archive);
+	errno = prev_errno;
+	return result == -1 ? -1 : imported;
+}
+
+/*
+* Paths that don't fit in the header are stored in a GNU long name record before it,
+* unless they can be split between the prefix and the name fields.
+*/
+static int writeHeader(TarArchive* archive, const char* path, size_t length, char typeflag, FAT_uint64_t size) {
+	TarHeader header;
+	size_t split = 0;
+	memset(&header, 0, sizeof(header));
+	if(length > sizeof(header.name)) {
+		/*
+		* First / leaving a name that fits, so that the prefix is the shortest
+		*/
+		for(split = length - sizeof(header.name) - 1; split < length - 1 && path[split] != '/'; ++split)
+			;
+		if(split == 0 || split >= length - 1 || split > sizeof(header.prefix)) {
+			if(writeHeader(archive, "././@LongLink", 13, TAR_TYPE_GNU_LONG_NAME, length + 1) == -1 ||
+			   writeFully(archive->descriptor, path, length) == -1)
+				return -1;
+			memset(archive->buffer, 0, TAR_BLOCK_SIZE);
+			if(writeFully(archive->descriptor, archive->buffer, roundToBlock(length + 1) - length) == -1)
+				return -1;
+			length = sizeof(header.name);
+		} else {
+			memcpy(header.prefix, path, split);
+			path += split + 1;
+			length -= split + 1;
+		}
+	}
+	memcpy(header.name, path, length);
+	formatNumber(header.mode, sizeof(header.mode), typeflag == TAR_TYPE_DIRECTORY ? 0755 : 0644);
+	formatNumber(header.uid, sizeof(header.uid), 0);
+	formatNumber(header.gid, sizeof(header.gid), 0);
+	formatNumber(header.size, sizeof(header.size), size);
+	formatNumber(header.mtime, sizeof(header.mtime), 0);
+	header.typeflag = typeflag;
+	memcpy(header.magic, "ustar", 6);
+	memcpy(header.version, "00", 2);
+	formatNumber(header.checksum, 7, computeHeaderChecksum(&header));
+	header.checksum[7] = ' ';
+	return writeFully(archive->descriptor, &header, sizeof(header));
+}
+
+static int exportFile(TarArchive* archive, const char* name) {
+	int err = -1;
+	int file_descriptor;
+	size_t chunk;
+	FAT_uint64_t size;
+	FAT_uint64_t remaining;
+	Handle handle;
+	file_descriptor = openFileFAT(archive->fat, name);
+	if(file_descriptor == -1)
+		return -1;
+	handle = getHandleFAT(archive->fat, file_descriptor);
+	if(seekFAT64(handle, 0, FAT_SEEK_END) == -1)
+		goto cleanup;
+	size = tellFAT64(handle);
+	if(seekFAT64(handle, 0, FAT_SEEK_SET) == -1 ||
+	   writeHeader(archive, archive->path, archive->path_length, TAR_TYPE_FILE, size) == -1)
+		goto cleanup;
+	for(remaining = roundToBlock(size); remaining > 0; remaining -= chunk) {
+		chunk = remaining < TAR_BUFFER_SIZE ? (size_t)remaining : TAR_BUFFER_SIZE;
+		/*
+		* The padding of the last block is zeroed
+		*/
+		memset(archive->buffer, 0, chunk);
+		if(readFAT64(handle, archive->buffer, chunk) == -1 || writeFully(archive->descriptor, archive->buffer, chunk) == -1)
+			goto cleanup;
+	}
+	err = 0;
+cleanup:
+	closeFileFAT(archive->fat, file_descriptor);
+	return err;
+}
+
+static int exportDirectory(TarArchive* archive) {
+	int err = 0;
+	size_t length;
+	size_t parent_length = archive->path_length;
+	DirectoryElement* cur_element;
+	DirectoryElement* contents = listDirFAT(archive->fat);
+	if(contents == NULL)
+		return -1;
+	for(cur_element = contents; cur_element->filename != NULL && err == 0; ++cur_element) {
+		length = strlen(cur_element->filename);
+		if(parent_length + length + 1 > TAR_MAX_PATH) {
+			errno = ENAMETOOLONG;
+			err = -1;
+			break;
+		}
+		memcpy(archive->path + parent_length, cur_element->filename, length);
+		archive->path_length = parent_length + length;
+		if(cur_element->file_type == FAT_DIRECTORY) {
+			archive->path[archive->path_length++] = '/';
+			if(writeHeader(archive, archive->path, archive->path_length, TAR_TYPE_DIRECTORY, 0) == -1 ||
+			   changeDirFAT(archive->fat, cur_element->filename) == -1)
+				err = -1;
+			else if((err = exportDirectory(archive)) == 0)
+				err = changeDirFAT(archive->fat, "..");
+		} else {
+			err = exportFile(archive, cur_element->filename);
+		}
+	}
+	archive->path_length = parent_length;
+	freeDirList(contents);
+	return err;
+}
+
+int exportTarFAT(FAT fat, int descriptor) {
+	int err;
+	TarArchive* archive = createArchive(fat, descriptor);
+	if(archive == NULL)
+		return -1;
+	err = exportDirectory(archive);
+	if(err == 0) {
+		/*
+		* The end of the archive is marked by two zero blocks
+		*/
+		memset(archive->buffer, 0, TAR_BLOCK_SIZE * 2);
+		err = writeFully(descriptor, archive->buffer, TAR_BLOCK_SIZE * 2);
+	}
+	freeArchive(archive);
+	return err;
+}
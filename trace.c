@@ -0,0 +1,155 @@
+#include "trace.h"
+#include <stdlib.h> /*malloc, free*/
+#include <string.h> /*memcpy, memcmp, strlen*/
+#include <errno.h> /*errno*/
+#include <time.h> /*clock_gettime*/
+
+#define TRACE_MAGIC "FATTRACE"
+#define TRACE_MAGIC_SIZE 8
+#define TRACE_VERSION 1
+
+/*
+* The fields are stored one after the other in the byte order of the host,
+* followed by the names, whose lengths are stored increased by 1, 0 meaning no name.
+*/
+#define TRACE_RECORD_HEADER_SIZE (1 + 4 * 2 + 8 * 5 + 2 * 2)
+
+FAT_uint64_t getTraceTime(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (FAT_uint64_t)now.tv_sec * 1000000000u + (FAT_uint64_t)now.tv_nsec;
+}
+
+FILE* createTrace(const char* trace_name) {
+	FAT_uint32_t version = TRACE_VERSION;
+	FILE* trace = fopen(trace_name, "wb");
+	if(trace == NULL)
+		return NULL;
+	if(fwrite(TRACE_MAGIC, TRACE_MAGIC_SIZE, 1, trace) != 1 || fwrite(&version, sizeof(version), 1, trace) != 1) {
+		fclose(trace);
+		return NULL;
+	}
+	return trace;
+}
+
+#define putField(buffer, field) do { memcpy(buffer, &(field), sizeof(field)); buffer += sizeof(field); } while(0)
+#define getField(buffer, field) do { memcpy(&(field), buffer, sizeof(field)); buffer += sizeof(field); } while(0)
+
+static FAT_uint16_t getStoredNameLength(const char* name) {
+	size_t length;
+	if(name == NULL)
+		return 0;
+	length = strlen(name);
+	return (FAT_uint16_t)((length > TRACE_MAX_NAME ? TRACE_MAX_NAME : length) + 1);
+}
+
+int writeTraceRecord(FILE* trace, const TraceRecord* record) {
+	char stack_buffer[TRACE_RECORD_HEADER_SIZE + 512];
+	char* buffer = stack_buffer;
+	char* cur;
+	size_t size;
+	int err = 0;
+	FAT_uint8_t operation = (FAT_uint8_t)record->operation;
+	FAT_uint16_t name_length = getStoredNameLength(record->name);
+	FAT_uint16_t name2_length = getStoredNameLength(record->name2);
+	size = TRACE_RECORD_HEADER_SIZE + (size_t)name_length + (size_t)name2_length;
+	if(size > sizeof(stack_buffer)) {
+		buffer = (char*)malloc(size);
+		if(buffer == NULL)
+			return -1;
+	}
+	cur = buffer;
+	putField(cur, operation);
+	putField(cur, record->handle);
+	putField(cur, record->mode);
+	putField(cur, record->argument);
+	putField(cur, record->argument2);
+	putField(cur, record->result);
+	putField(cur, record->start);
+	putField(cur, record->duration);
+	putField(cur, name_length);
+	putField(cur, name2_length);
+	if(name_length > 0) {
+		memcpy(cur, record->name, (size_t)(name_length - 1));
+		cur += name_length - 1;
+	}
+	if(name2_length > 0) {
+		memcpy(cur, record->name2, (size_t)(name2_length - 1));
+		cur += name2_length - 1;
+	}
+	if(fwrite(buffer, (size_t)(cur - buffer), 1, trace) != 1)
+		err = -1;
+	if(buffer != stack_buffer)
+		free(buffer);
+	return err;
+}
+
+TraceReader* openTrace(const char* trace_name) {
+	char magic[TRACE_MAGIC_SIZE];
+	FAT_uint32_t version;
+	TraceReader* reader = (TraceReader*)malloc(sizeof(TraceReader));
+	if(reader == NULL)
+		return NULL;
+	reader->file = fopen(trace_name, "rb");
+	if(reader->file == NULL) {
+		free(reader);
+		return NULL;
+	}
+	if(fread(magic, sizeof(magic), 1, reader->file) != 1 || memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0 ||
+	   fread(&version, sizeof(version), 1, reader->file) != 1 || version != TRACE_VERSION) {
+		closeTrace(reader);
+		errno = EINVAL;
+		return NULL;
+	}
+	return reader;
+}
+
+static int readTraceName(TraceReader* reader, char* name, FAT_uint16_t stored_length, const char** out) {
+	if(stored_length == 0) {
+		*out = NULL;
+		return 0;
+	}
+	if(stored_length > 1 && fread(name, (size_t)(stored_length - 1), 1, reader->file) != 1)
+		return -1;
+	name[stored_length - 1] = '\0';
+	*out = name;
+	return 0;
+}
+
+int readTraceRecord(TraceReader* reader, TraceRecord* record) {
+	char header[TRACE_RECORD_HEADER_SIZE];
+	const char* cur = header;
+	FAT_uint8_t operation;
+	FAT_uint16_t name_length;
+	FAT_uint16_t name2_length;
+	size_t read = fread(header, 1, sizeof(header), reader->file);
+	if(read == 0 && feof(reader->file))
+		return 0;
+	if(read != sizeof(header)) {
+		errno = EINVAL;
+		return -1;
+	}
+	getField(cur, operation);
+	getField(cur, record->handle);
+	getField(cur, record->mode);
+	getField(cur, record->argument);
+	getField(cur, record->argument2);
+	getField(cur, record->result);
+	getField(cur, record->start);
+	getField(cur, record->duration);
+	getField(cur, name_length);
+	getField(cur, name2_length);
+	record->operation = (TraceOperation)operation;
+	if(operation == 0 || operation >= TRACE_OPERATIONS_END ||
+	   readTraceName(reader, reader->name, name_length, &record->name) == -1 ||
+	   readTraceName(reader, reader->name2, name2_length, &record->name2) == -1) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 1;
+}
+
+void closeTrace(TraceReader* reader) {
+	fclose(reader->file);
+	free(reader);
+}
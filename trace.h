@@ -0,0 +1,117 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdio.h> /*FILE*/
+#include "FAT.h" /*FAT_int64_t, FAT_uint64_t*/
+
+/*
+* Longest name or path stored in a trace record.
+*/
+#define TRACE_MAX_NAME 65534
+
+typedef enum TraceOperation {
+	TRACE_OPEN = 1,
+	TRACE_CLOSE,
+	TRACE_ERASE,
+	TRACE_ERASE_AT,
+	TRACE_CLONE,
+	TRACE_DEDUP,
+	TRACE_COMPRESS,
+	TRACE_WRITE,
+	TRACE_READ,
+	TRACE_WRITEV,
+	TRACE_READV,
+	TRACE_SEEK,
+	TRACE_TRUNCATE,
+	/*
+	* Followed by one TRACE_BATCH_OPERATION record for each operation of the batch
+	*/
+	TRACE_BATCH,
+	TRACE_BATCH_OPERATION,
+	TRACE_CREATE_DIR,
+	TRACE_ERASE_DIR,
+	TRACE_ERASE_TREE,
+	TRACE_RENAME,
+	TRACE_MOVE,
+	TRACE_CHANGE_DIR,
+	TRACE_LIST_DIR,
+	TRACE_FIND,
+	TRACE_SCRUB,
+	TRACE_SNAPSHOT,
+	TRACE_STAT_DIR,
+	TRACE_SET_QUOTA,
+	TRACE_OPERATIONS_END
+} TraceOperation;
+
+/*
+* A single call to the library, the meaning of the arguments depends on the operation:
+* the size of reads, writes, truncates and batch operations goes in argument,
+* the offset of seeks and batch operations in argument and argument2 respectively,
+* and the whence of seeks, the mode of searches, the number of buffers of vectored
+* transfers, the type of batch operations and the threads of scrubs go in mode.
+* Quotas store the size limit in argument and the entries limit in mode.
+*/
+typedef struct TraceRecord {
+	TraceOperation operation;
+	/*
+	* Descriptor of the handle used by the call, -1 if it doesn't use one
+	*/
+	FAT_int32_t handle;
+	FAT_int32_t mode;
+	FAT_int64_t argument;
+	FAT_int64_t argument2;
+	FAT_int64_t result;
+	/*
+	* Nanoseconds since an arbitrary point, the same for all the processes in the machine
+	*/
+	FAT_uint64_t start;
+	FAT_uint64_t duration;
+	/*
+	* NULL if not used by the call
+	*/
+	const char* name;
+	const char* name2;
+} TraceRecord;
+
+/*
+* Used to read the records of a trace, the names of the last read record
+* are kept in the reader.
+*/
+typedef struct TraceReader {
+	FILE* file;
+	char name[TRACE_MAX_NAME + 1];
+	char name2[TRACE_MAX_NAME + 1];
+} TraceReader;
+
+/*
+* Returns the current time in nanoseconds, as used by TraceRecord.
+*/
+FAT_uint64_t getTraceTime(void);
+
+/*
+* Creates a new trace file at the passed path.
+* Returns NULL on error.
+*/
+FILE* createTrace(const char* trace_name);
+
+/*
+* Appends the record to the trace, the record is written with a single call
+* so that threads sharing the file don't mix up their records.
+* Returns -1 on error.
+*/
+int writeTraceRecord(FILE* trace, const TraceRecord* record);
+
+/*
+* Returns NULL on error, with errno set to EINVAL if the file isn't a trace.
+*/
+TraceReader* openTrace(const char* trace_name);
+
+/*
+* Reads the next record, its names stay valid until the following call.
+* Returns 1 if a record was read, 0 at the end of the trace.
+* Returns -1 on error.
+*/
+int readTraceRecord(TraceReader* reader, TraceRecord* record);
+
+void closeTrace(TraceReader* reader);
+
+#endif /*TRACE_H*/